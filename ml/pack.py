@@ -0,0 +1,96 @@
+import numpy as np
+import sys
+import os
+import struct
+
+# Packs the dense layers of a model into the single file src/model.c maps,
+# a header, one descriptor per layer, then every tensor on a 64 byte
+# boundary. The first layer is stored with the input normalization folded
+# in so the predictor can map the weights and use them as they are.
+#
+# usage: python3 pack.py [model dir]
+
+MODEL_FILE = 'model.avm'
+MODEL_MAGIC = b'AVDM'
+MODEL_VERSION = 1
+MODEL_ALIGN = 64
+HDR_SIZE = 32
+LAYER_SIZE = 32
+
+ACTIVATIONS = { 'relu': 1, 'softmax': 2 }
+LAYERS = [('dense', 'relu'), ('dense_1', 'softmax')]
+
+# what trainer.py's process_example() does to each pixel
+PIXEL_SCALE = 1 / 255.0
+PIXEL_OFFSET = -0.5
+
+
+def load_tensor(path):
+    with open(path, mode='rb') as file:
+        dims = struct.unpack('b', file.read(1))[0]
+        shape = struct.unpack('%di' % dims, file.read(4 * dims))
+        return np.fromfile(file, dtype=np.float32).reshape(shape)
+
+
+def fold_input(kernel, bias, scale, offset):
+    # sum_i (v_i * scale + offset) * w_ij + b_j
+    #   = sum_i v_i * (scale * w_ij) + (b_j + offset * sum_i w_ij)
+    kernel = kernel.astype(np.float64)
+    return kernel * scale, bias + offset * kernel.sum(axis=0)
+
+
+def align(n):
+    return (n + MODEL_ALIGN - 1) // MODEL_ALIGN * MODEL_ALIGN
+
+
+def write_model(path, layers):
+    """layers is a list of (kernel [in][out], bias [out], activation name)"""
+    kernel, bias, act = layers[0]
+    layers = [fold_input(kernel, bias, PIXEL_SCALE, PIXEL_OFFSET) + (act,)] + layers[1:]
+
+    off = align(HDR_SIZE + LAYER_SIZE * len(layers))
+    descs, tensors = b'', []
+
+    for kernel, bias, act in layers:
+        w = np.ascontiguousarray(kernel, dtype='<f4')
+        b = np.ascontiguousarray(bias, dtype='<f4').reshape(-1)
+        w_off = off
+        b_off = align(w_off + w.nbytes)
+        off = align(b_off + b.nbytes)
+
+        descs += struct.pack('<IIIIQQ', w.shape[0], w.shape[1], ACTIVATIONS[act], 0, w_off, b_off)
+        tensors += [(w_off, w), (b_off, b)]
+
+    # written aside and renamed over the old one, a running predictor maps
+    # the file and reloads it as soon as it appears
+    tmp_path = path + '.tmp'
+
+    with open(tmp_path, mode='wb') as file:
+        file.write(struct.pack('<4sIIIffQ', MODEL_MAGIC, MODEL_VERSION, len(layers), 0, 1.0, 0.0, off))
+        file.write(descs)
+
+        for t_off, t in tensors:
+            file.write(b'\0' * (t_off - file.tell()))
+            file.write(t.tobytes())
+
+        file.write(b'\0' * (off - file.tell()))
+
+    os.replace(tmp_path, path)
+    return off
+
+
+def main(argv):
+    model_dir = argv[1] if len(argv) > 1 else '/var/model/'
+    layers = []
+
+    for name, act in LAYERS:
+        kernel = load_tensor(os.path.join(model_dir, name + '.kernel'))
+        bias = load_tensor(os.path.join(model_dir, name + '.bias'))
+        layers += [(kernel, bias, act)]
+
+    size = write_model(os.path.join(model_dir, MODEL_FILE), layers)
+    print('%s: %d layers, %d bytes' % (MODEL_FILE, len(layers), size))
+
+
+if __name__ == '__main__':
+    main(sys.argv)
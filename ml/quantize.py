@@ -0,0 +1,154 @@
+import numpy as np
+from PIL import Image
+import sys
+import os
+import struct
+
+# Converts the float dense layers exported by trainer.py into the int8
+# format read by src/qdense.c, then reports how closely the int8 model
+# follows the float one on the patches of every image in the test set.
+#
+# usage: python3 quantize.py [model dir] [test image dir]
+
+PATCH_SIDE = 16
+STRIDE = 8
+LAYERS = ['dense', 'dense_1']
+
+QDENSE_MAGIC = b'AVQ8'
+QDENSE_VERSION = 1
+
+PIXEL_SCALE = np.float32(1 / 255.0)
+PIXEL_OFFSET = np.float32(0.5)
+
+
+def load_tensor(path):
+    with open(path, mode='rb') as file:
+        dims = struct.unpack('b', file.read(1))[0]
+        shape = struct.unpack('%di' % dims, file.read(4 * dims))
+        return np.fromfile(file, dtype=np.float32).reshape(shape)
+
+
+def round_away(x):
+    # half away from zero, same as qdense_quantize_rows()
+    return np.trunc(x + np.where(x < 0, -0.5, 0.5))
+
+
+def quantize_layer(kernel, bias):
+    # one scale per output channel, so a channel with small weights keeps
+    # its resolution
+    amax = np.abs(kernel).max(axis=0)
+    scale = np.where(amax > 0, amax / 127.0, 1.0).astype(np.float32)
+    q = np.clip(round_away(kernel / scale), -127, 127).astype(np.int8)
+
+    return { 'w': q.T.copy(), 'scale': scale, 'bias': bias.astype(np.float32) }
+
+
+def write_layer(path, layer):
+    out, inputs = layer['w'].shape
+
+    with open(path, mode='wb') as file:
+        file.write(struct.pack('<4sIII', QDENSE_MAGIC, QDENSE_VERSION, inputs, out))
+        file.write(layer['scale'].astype('<f4').tobytes())
+        file.write(layer['bias'].astype('<f4').tobytes())
+        file.write(layer['w'].tobytes())
+
+
+def relu(x):
+    return np.maximum(x, 0)
+
+
+def softmax(x):
+    e = np.exp(x - x.max(axis=1, keepdims=True))
+    return e / e.sum(axis=1, keepdims=True)
+
+
+def float_model(layers, X):
+    h = relu(X.dot(layers[0][0]) + layers[0][1])
+    return softmax(h.dot(layers[1][0]) + layers[1][1])
+
+
+def quantized_dense(layer, q, x_scale, offset):
+    # int32 accumulation like qdense_forward()
+    acc = q.astype(np.int32).dot(layer['w'].T.astype(np.int32)).astype(np.float32)
+    sums = layer['w'].astype(np.int32).sum(axis=1).astype(np.float32)
+    return x_scale[:, None] * layer['scale'] * (acc + offset * sums) + layer['bias']
+
+
+def quantized_model(qlayers, codes):
+    m = codes.shape[0]
+    h = relu(quantized_dense(qlayers[0], codes, np.full(m, PIXEL_SCALE), PIXEL_OFFSET))
+
+    # hidden activations are requantized per row
+    amax = np.abs(h).max(axis=1)
+    h_scale = np.where(amax > 0, amax / 127.0, 1.0).astype(np.float32)
+    hq = np.clip(round_away(h * (1 / h_scale)[:, None]), -127, 127).astype(np.int8)
+
+    return softmax(quantized_dense(qlayers[1], hq, h_scale, 0))
+
+
+def image_patches(path):
+    img = np.array(Image.open(path).convert('RGB'))
+    h, w, _ = img.shape
+    patches = []
+
+    for y in range(0, h - PATCH_SIDE + 1, STRIDE):
+        for x in range(0, w - PATCH_SIDE + 1, STRIDE):
+            patches += [img[y:y + PATCH_SIDE, x:x + PATCH_SIDE].flatten()]
+
+    return np.array(patches, dtype=np.uint8)
+
+
+def report(layers, qlayers, test_dir):
+    total, agree, err_sum, err_max = 0, 0, 0.0, 0.0
+
+    print('%-24s %8s %8s %10s %10s' % ('image', 'patches', 'top-1', 'mean |dp|', 'max |dp|'))
+
+    for name in sorted(os.listdir(test_dir)):
+        if not name.endswith('.png'): continue
+
+        pixels = image_patches(os.path.join(test_dir, name))
+        if not len(pixels): continue
+
+        # the float path's input is pixel / 255 - 0.5, the int8 path's is pixel - 128
+        p_float = float_model(layers, pixels.astype(np.float32) / 255.0 - 0.5)
+        p_quant = quantized_model(qlayers, (pixels.astype(np.int16) - 128).astype(np.int8))
+
+        same = (p_float.argmax(axis=1) == p_quant.argmax(axis=1)).sum()
+        err = np.abs(p_float - p_quant)
+
+        print('%-24s %8d %7.2f%% %10.5f %10.5f' % (name, len(pixels), 100.0 * same / len(pixels), err.mean(), err.max()))
+
+        total += len(pixels)
+        agree += same
+        err_sum += err.mean() * len(pixels)
+        err_max = max(err_max, err.max())
+
+    if total:
+        print('%-24s %8d %7.2f%% %10.5f %10.5f' % ('all', total, 100.0 * agree / total, err_sum / total, err_max))
+
+
+def main(argv):
+    model_dir = argv[1] if len(argv) > 1 else '/var/model/'
+    test_dir = argv[2] if len(argv) > 2 else 'ds/test'
+
+    layers, qlayers = [], []
+    float_bytes, quant_bytes = 0, 0
+
+    for name in LAYERS:
+        kernel = load_tensor(os.path.join(model_dir, name + '.kernel'))
+        bias = load_tensor(os.path.join(model_dir, name + '.bias'))
+        layer = quantize_layer(kernel, bias)
+
+        write_layer(os.path.join(model_dir, name + '.q8'), layer)
+
+        layers += [(kernel, bias)]
+        qlayers += [layer]
+        float_bytes += kernel.nbytes
+        quant_bytes += layer['w'].nbytes + layer['scale'].nbytes
+
+    print('weights: %d bytes float, %d bytes int8' % (float_bytes, quant_bytes))
+    report(layers, qlayers, test_dir)
+
+
+if __name__ == '__main__':
+    main(sys.argv)
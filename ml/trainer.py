@@ -6,6 +6,7 @@ import sys
 import os
 import signal
 import struct
+import pack
 
 IS_TRAINING = True
 PATCH_SIDE = 16
@@ -309,6 +310,13 @@ def export_model(model):
                     for w in param.flatten():
                         file.write(struct.pack('f', w))
 
+    # the same layers packed into the one file the predictor maps
+    layers = []
+    for name, act in pack.LAYERS:
+        layers += [(model.get_variable_value(name + '/kernel'), model.get_variable_value(name + '/bias'), act)]
+
+    pack.write_model('/var/model/' + pack.MODEL_FILE, layers)
+
 
 def train(hyper_params):
     # Get the set of all the labels and file paths, pre shuffled
@@ -9,6 +9,7 @@
 
 int INPUT_FD = 0;
 int FORWARD_STATE = 0;
+int TIMEOUT_MS = -1;
 int I2C_BUS;
 
 calib_t CAL;
@@ -20,6 +21,7 @@ time_t LAST_SECOND;
 void sig_handler(int sig)
 {
 	b_log("Caught signal %d", sig);
+	pipeline_log_stats();
 	pwm_set_echo(0x6);
 	usleep(10000);
 	exit(0);
@@ -49,6 +51,13 @@ int main(int argc, char* const argv[])
 			.set = &PWM_CHANNEL_MSK,
 			.type = ARG_TYP_INT,
 		},
+		{ 't',
+			.desc = "Stop the platform if no action arrives within this many milliseconds",
+			.usage = "-t [timeout_ms]",
+			.opts = { .has_value = 1 },
+			.set = &TIMEOUT_MS,
+			.type = ARG_TYP_INT,
+		},
 		{} // terminator
 	};
 	cli("Recieves action vectors over stdin and actuates the platform",
@@ -65,15 +74,42 @@ int main(int argc, char* const argv[])
 		pwm_set_echo(PWM_CHANNEL_MSK);
 	}
 
+	// only the action is needed unless the state is being forwarded
+	uint16_t fields = FORWARD_STATE ? FIELD_ALL : FIELD_ACTION;
+	message_t* msg = message_alloc(PAYLOAD_PAIR, fields);
+	assert(msg);
+
+	if (TIMEOUT_MS >= 0)
+	{
+		assert(pipeline_set_timeout(TIMEOUT_MS) == PIPE_OK);
+	}
+
+	int stopped = 0;
 	while(1)
 	{
-		message_t msg = {};
+		int res = read_pipeline_fields(msg, PAYLOAD_PAIR, fields);
+
+		if (res == PIPE_TIMEOUT)
+		{
+			if (!stopped) b_bad("No action within %dms, stopping", TIMEOUT_MS);
+			stopped = 1;
+
+			if (I2C_BUS > -1)
+			{
+				raw_action_t act = { 117, 117 };
+				pwm_set_action(&act);
+			}
+
+			continue;
+		}
 
-		if (!read_pipeline_payload(&msg, PAYLOAD_PAIR))
+		if (!res)
 		{
+			stopped = 0;
+
 			if (I2C_BUS > -1)
 			{
-				pwm_set_action(&msg.payload.action);
+				pwm_set_action(&msg->payload.action);
 			}
 			else
 			{
@@ -85,13 +121,13 @@ int main(int argc, char* const argv[])
 				}
 				else
 				{
-					write(sim_pipe, &msg.payload.action, sizeof(msg.payload.action));
+					write(sim_pipe, &msg->payload.action, sizeof(msg->payload.action));
 				}
 			}
 
 			if (FORWARD_STATE)
 			{
-				if (write_pipeline_payload(&msg))
+				if (write_pipeline_payload(msg))
 				{
 					b_bad("Failed to write payload");
 					return -1;
@@ -100,7 +136,6 @@ int main(int argc, char* const argv[])
 		}
 		else
 		{
-			b_bad("read error");
 			if (I2C_BUS > -1)
 			{
 				// stop everything
@@ -108,10 +143,18 @@ int main(int argc, char* const argv[])
 				pwm_set_action(&act);
 			}
 
+			if (res == PIPE_EOF)
+			{
+				b_log("Upstream closed");
+				break;
+			}
+
+			b_bad("read error (%d)", res);
 			return -1;
 		}
 	}
 
+	pipeline_log_stats();
 	b_bad("terminating");
 
 	return 0;
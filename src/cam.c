@@ -2,6 +2,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
 #include <string.h>
 #include <strings.h>
 #include <fcntl.h>
@@ -17,10 +18,14 @@
 
 #define CAM_FPS 5
 
+// longest a frame may take before capture is considered stalled
+#define CAM_TIMEOUT_MS 1000
+
 cam_t cam_open(const char* path, cam_settings_t* cfg)
 {
 
-	int fd = open(path, O_RDWR);
+	// non-blocking so frames that queued up can be drained without waiting
+	int fd = open(path, O_RDWR | O_NONBLOCK);
 	int res;
 
 	if(fd < 0)
@@ -28,7 +33,8 @@ cam_t cam_open(const char* path, cam_settings_t* cfg)
 		b_bad("Error opening video device '%s'", path);
 		//exit(-1);
 
-		cam_t empty = {};
+		// nothing to requeue or poll, so later calls can't touch fd 0
+		cam_t empty = { .fd = -1, .epoll_fd = -1, .held = -1 };
 		return empty;
 	}
 
@@ -56,7 +62,7 @@ cam_t cam_open(const char* path, cam_settings_t* cfg)
 	struct v4l2_requestbuffers bufrequest = {};
 	bufrequest.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	bufrequest.memory = V4L2_MEMORY_MMAP;
-	bufrequest.count = 2;
+	bufrequest.count = cfg->buffers ? cfg->buffers : CAM_BUFFERS_DEFAULT;
 
 	if(ioctl(fd, VIDIOC_REQBUFS, &bufrequest) < 0)
 	{
@@ -65,7 +71,7 @@ cam_t cam_open(const char* path, cam_settings_t* cfg)
 	}
 
 
-	if(bufrequest.count < 2)
+	if(bufrequest.count < CAM_BUFFERS_MIN)
 	{
 		b_bad("Not enough memory");
 		exit(-5);
@@ -73,7 +79,7 @@ cam_t cam_open(const char* path, cam_settings_t* cfg)
 
 
 	struct v4l2_buffer bufferinfo = {};
-	void** fbs = calloc(sizeof(void*), bufrequest.count);
+	void** fbs = (void**)calloc(bufrequest.count, sizeof(void*));
 	for(int i = bufrequest.count; i--;)
 	{
 		bufferinfo.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -105,15 +111,28 @@ cam_t cam_open(const char* path, cam_settings_t* cfg)
 		ioctl(fd, VIDIOC_QBUF, &bufferinfo);
 	}
 
+	b_log("'%s' capturing %dx%d frames into %d buffers", path, cfg->width, cfg->height, bufrequest.count);
+
+	struct epoll_event ev = { .events = EPOLLIN };
+	int epoll_fd = epoll_create(1);
+	if(epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev))
+	{
+		b_bad("Couldn't poll '%s' (%d)", path, errno);
+		exit(-7);
+	}
 
 	cam_t cam = {
 		.fd = fd,
+		.epoll_fd = epoll_fd,
+		.buffers = bufrequest.count,
+		.width = cfg->width,
+		.height = cfg->height,
+		.pitch = cfg->pitch,
 		.frame_buffers = fbs,
 		.buffer_info = bufferinfo,
+		.held = -1,
 	};
 
-	cam_wait_frame(&cam);
-
 	int type = bufferinfo.type;
 	if(ioctl(fd, VIDIOC_STREAMON, &type) < 0)
 	{
@@ -127,23 +146,106 @@ cam_t cam_open(const char* path, cam_settings_t* cfg)
 
 int cam_request_frame(cam_t* cam)
 {
-	cam->buffer_info.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	cam->buffer_info.memory = V4L2_MEMORY_MMAP;
+	if (cam->held < 0) return 0;
+
+	struct v4l2_buffer buf = {
+		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+		.memory = V4L2_MEMORY_MMAP,
+		.index = cam->held,
+	};
+
+	cam->held = -1;
+
+	return ioctl(cam->fd, VIDIOC_QBUF, &buf);
+}
+
+
+static void cam_count_frame(cam_t* cam, const struct v4l2_buffer* buf)
+{
+	// the driver numbers every frame it captures, including the ones it
+	// had no free buffer for
+	if (cam->frames && buf->sequence > cam->last_sequence + 1)
+	{
+		cam->dropped += buf->sequence - cam->last_sequence - 1;
+	}
 
-	return ioctl(cam->fd, VIDIOC_QBUF, &cam->buffer_info);
+	cam->last_sequence = buf->sequence;
+	cam->frames++;
 }
 
 
 int cam_wait_frame(cam_t* cam)
 {
-	ioctl(cam->fd, VIDIOC_DQBUF, &cam->buffer_info);
+	struct v4l2_buffer buf = {
+		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+		.memory = V4L2_MEMORY_MMAP,
+	};
+	int got = 0;
+
+	cam_request_frame(cam);
+
+	while (!got)
+	{
+		struct epoll_event ev;
+		int res = epoll_wait(cam->epoll_fd, &ev, 1, CAM_TIMEOUT_MS);
+
+		if (res < 0 && errno == EINTR) continue;
+		if (res <= 0)
+		{
+			b_bad("No frame within %dms (%d)", CAM_TIMEOUT_MS, errno);
+			return -1;
+		}
+
+		// take every frame that's ready, keeping only the newest so a
+		// slow frame doesn't leave the next ones further behind
+		while (ioctl(cam->fd, VIDIOC_DQBUF, &buf) == 0)
+		{
+			cam_count_frame(cam, &buf);
+
+			if (got)
+			{
+				cam->late++;
+				cam_request_frame(cam);
+			}
+
+			cam->held = buf.index;
+			cam->buffer_info = buf;
+			got = 1;
+		}
+
+		if (errno != EAGAIN && errno != EINTR)
+		{
+			b_bad("VIDIOC_DQBUF (%d)", errno);
+			return -2;
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief CLOCK_MONOTONIC time in microseconds that the last dequeued frame
+ *        was captured. Falls back to the current time for drivers that
+ *        don't timestamp with the monotonic clock.
+ */
+uint64_t cam_frame_us(cam_t* cam)
+{
+	struct v4l2_buffer* buf = &cam->buffer_info;
+
+	if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+	{
+		return buf->timestamp.tv_sec * 1000000ULL + buf->timestamp.tv_usec;
+	}
+
+	return mono_us();
 }
 
 
 int cam_config(int fd, cam_settings_t* cfg)
 {
 	int res = 0;
-	struct v4l2_format format;
+	struct v4l2_format format = {};
 
 	if(!cfg)
 	{
@@ -160,8 +262,32 @@ int cam_config(int fd, cam_settings_t* cfg)
 	}
 */
 
+	// cropping comes first, the driver scales what's left to the format
+	if(cfg->crop.width && cfg->crop.height)
+	{
+		struct v4l2_selection sel = {
+			.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+			.target = V4L2_SEL_TGT_CROP,
+			.r = {
+				.left = cfg->crop.left,
+				.top = cfg->crop.top,
+				.width = cfg->crop.width,
+				.height = cfg->crop.height,
+			},
+		};
+
+		if(ioctl(fd, VIDIOC_S_SELECTION, &sel) < 0)
+		{
+			b_bad("Error: failed cropping to %dx%d at (%d, %d)", cfg->crop.width, cfg->crop.height, cfg->crop.left, cfg->crop.top);
+			return -4;
+		}
+
+		b_log("Cropped to %ux%u at (%d, %d)", sel.r.width, sel.r.height, sel.r.left, sel.r.top);
+	}
+
 	format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	format.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+	format.fmt.pix.field = V4L2_FIELD_NONE;
 	format.fmt.pix.width = cfg->width;
 	format.fmt.pix.height = cfg->height;
 
@@ -171,6 +297,16 @@ int cam_config(int fd, cam_settings_t* cfg)
 		return -3;
 	}
 
+	if(format.fmt.pix.pixelformat != V4L2_PIX_FMT_YUYV)
+	{
+		b_bad("Error: camera doesn't capture YUYV");
+		return -5;
+	}
+
+	cfg->width = format.fmt.pix.width;
+	cfg->height = format.fmt.pix.height;
+	cfg->pitch = format.fmt.pix.bytesperline ? (int)format.fmt.pix.bytesperline : cfg->width * 2;
+
 	struct v4l2_streamparm parm = {};
 
 	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
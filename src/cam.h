@@ -2,35 +2,75 @@
 #define AVC_CAM
 
 #include <time.h>
+#include <inttypes.h>
 
 #ifdef __linux__
 #include <linux/videodev2.h>
-#include <inttypes.h>
 #include <sys/types.h>
 #endif
 
 #define GET_CHROMA_FROM_VIEW(view, r, c) (view).chroma[((r) * FRAME_W >> 1) + ((r) >> 1)]
 
+// buffers the driver fills, more give the reader longer to keep up
+#define CAM_BUFFERS_DEFAULT 4
+#define CAM_BUFFERS_MIN 2
+#define CAM_BUFFERS_MAX 8
+
 typedef struct {
+	int left, top;
 	int width, height;
+} cam_rect_t;
+
+typedef struct {
+	int width, height; // requested, cam_config sets what the driver chose
+	int pitch;         // set by cam_config, bytes from one row to the next
 	int frame_rate;	
+	int buffers;
+	cam_rect_t crop;   // area of the sensor to capture, zero sized for all of it
 } cam_settings_t;
 
 typedef struct {
 	int fd;
+	int epoll_fd;
+	int buffers;
+	int width, height, pitch; // of the frames captured, see cam_settings_t
 	void** frame_buffers;
 #ifdef __linux__
-	struct v4l2_buffer buffer_info;
+	struct v4l2_buffer buffer_info; // the last frame dequeued
 #endif
+	int held;        // buffer the last frame is in, -1 once it's requeued
+	uint32_t last_sequence;
+	uint64_t frames; // dequeued from the driver
+	uint64_t dropped; // captured by the driver with no buffer to put them in
+	uint64_t late;   // dequeued behind a newer frame and skipped
 } cam_t;
 
 // Set when cam_config is called
 extern size_t CAM_BYTES_PER_FRAME;
 
+/**
+ * @brief Crops the sensor, if asked to, then sets the YUYV frame size and
+ *        rate. The driver picks the size nearest the one requested, which
+ *        is written back to cfg along with its pitch.
+ * @return 0 on success
+ */
 int   cam_config(int fd, cam_settings_t* cfg);
 cam_t cam_open(const char* path, cam_settings_t* cfg);
 
+/**
+ * @brief Gives the buffer of the last frame back to the driver, if it's
+ *        still held. All the others stay queued at all times.
+ * @return 0 on success
+ */
 int cam_request_frame(cam_t* cam);
+
+/**
+ * @brief Waits for a frame and dequeues it, requeueing the previous one
+ *        first. If several are ready only the newest is kept, the rest
+ *        are counted as late.
+ * @return 0 on success
+ */
 int cam_wait_frame(cam_t* cam);
+uint64_t cam_frame_us(cam_t* cam);
 
 #endif
@@ -0,0 +1,250 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "classifier.h"
+
+// rows of the weight matrix per tile, sized so a tile stays in L1 while
+// every row of the batch is multiplied against it
+#define TILE_BYTES (16 * 1024)
+
+
+int batch_init(batch_t* batch, nn_layer_t* L, int capacity)
+{
+	memset(batch, 0, sizeof(batch_t));
+
+	batch->capacity = capacity;
+	batch->inputs = L[0].w.dims[0];
+	batch->x = (float*)calloc(capacity * batch->inputs, sizeof(float));
+	if (!batch->x) return -1;
+
+	int widest = batch->inputs;
+	for (; L[batch->layers].w.data.f; ++batch->layers)
+	{
+		if (batch->layers == CLASSIFIER_MAX_LAYERS || !L[batch->layers].A) return -2;
+
+		batch->a[batch->layers] = (float*)calloc(capacity * L[batch->layers].w.dims[1], sizeof(float));
+		if (!batch->a[batch->layers]) return -1;
+
+		batch->outputs = L[batch->layers].w.dims[1];
+		widest = batch->outputs > widest ? batch->outputs : widest;
+	}
+
+	batch->xq = (int8_t*)calloc(capacity * batch->inputs, sizeof(int8_t));
+	batch->xq_scale = (float*)calloc(capacity, sizeof(float));
+	batch->hq = (int8_t*)calloc(capacity * widest, sizeof(int8_t));
+	batch->hq_scale = (float*)calloc(capacity, sizeof(float));
+	if (!batch->xq || !batch->xq_scale || !batch->hq || !batch->hq_scale) return -1;
+
+	for (int i = capacity; i--;)
+	{
+		batch->xq_scale[i] = Q8_PIXEL_SCALE;
+	}
+
+	return 0;
+}
+
+
+void batch_free(batch_t* batch)
+{
+	free(batch->x);
+	free(batch->xq);
+	free(batch->xq_scale);
+	free(batch->hq);
+	free(batch->hq_scale);
+
+	for (int l = 0; l < batch->layers; ++l)
+	{
+		free(batch->a[l]);
+	}
+
+	memset(batch, 0, sizeof(batch_t));
+}
+
+
+void classifier_fold_input(nn_layer_t* layer, float scale, float offset)
+{
+	const int in = layer->w.dims[0], out = layer->w.dims[1];
+	float* w = layer->w.data.f;
+	float* b = layer->b.data.f;
+
+	// sum_i (v_i * scale + offset) * w_ij + b_j
+	//   = sum_i v_i * (scale * w_ij) + (b_j + offset * sum_i w_ij)
+	for (int i = 0; i < in; ++i)
+	for (int j = 0; j < out; ++j)
+	{
+		b[j] += offset * w[i * out + j];
+		w[i * out + j] *= scale;
+	}
+}
+
+
+void batch_reset(batch_t* batch)
+{
+	batch->count = 0;
+}
+
+
+float* batch_row(batch_t* batch)
+{
+	if (batch->count >= batch->capacity) return NULL;
+
+	return batch->x + batch->inputs * batch->count++;
+}
+
+
+int8_t* batch_row_q8(batch_t* batch)
+{
+	if (batch->count >= batch->capacity) return NULL;
+
+	return batch->xq + batch->inputs * batch->count++;
+}
+
+
+static void dense(const float* x, int rows, int in, const mat_t* w, const mat_t* b, float* y)
+{
+	const int out = w->dims[1];
+	const int tile = TILE_BYTES / (out * sizeof(float)) > 0 ? TILE_BYTES / (out * sizeof(float)) : 1;
+
+	for (int i = 0; i < rows; ++i)
+	{
+		memcpy(y + i * out, b->data.f, out * sizeof(float));
+	}
+
+	for (int k0 = 0; k0 < in; k0 += tile)
+	{
+		const int k1 = k0 + tile < in ? k0 + tile : in;
+
+		for (int i = 0; i < rows; ++i)
+		{
+			const float* x_i = x + i * in;
+			float* y_i = y + i * out;
+
+			for (int k = k0; k < k1; ++k)
+			{
+				const float x_ik = x_i[k];
+				const float* w_k = w->data.f + k * out;
+
+				for (int j = 0; j < out; ++j)
+				{
+					y_i[j] += x_ik * w_k[j];
+				}
+			}
+		}
+	}
+}
+
+
+// activations like softmax work across a whole matrix, so apply them a
+// row at a time through a copy of the layer's own output
+static void activate(batch_t* batch, nn_layer_t* layer, float* y)
+{
+	const int out = layer->w.dims[1];
+
+	for (int i = 0; i < batch->count; ++i)
+	{
+		mat_t row = *layer->A;
+		row.data.f = y + i * out;
+		layer->activation(&row);
+	}
+}
+
+
+// first layer of a patch classifier as a convolution, the same as dense()
+// on the patches' rows but reading each patch row straight from the image
+static void conv(const float* img, int pitch, int seg, const int* corners, int rows, const mat_t* w, const mat_t* b, float* y)
+{
+	const int in = w->dims[0], out = w->dims[1];
+
+	for (int i = 0; i < rows; ++i)
+	{
+		memcpy(y + i * out, b->data.f, out * sizeof(float));
+	}
+
+	// one patch row of weights at a time, it stays in cache for every patch
+	for (int k0 = 0; k0 < in; k0 += seg)
+	{
+		const int kr = k0 / seg;
+
+		for (int i = 0; i < rows; ++i)
+		{
+			const float* x_i = img + corners[i] + kr * pitch;
+			float* y_i = y + i * out;
+
+			for (int k = 0; k < seg; ++k)
+			{
+				const float x_ik = x_i[k];
+				const float* w_k = w->data.f + (k0 + k) * out;
+
+				for (int j = 0; j < out; ++j)
+				{
+					y_i[j] += x_ik * w_k[j];
+				}
+			}
+		}
+	}
+}
+
+
+static float* forward(batch_t* batch, nn_layer_t* L, int first, const float* x)
+{
+	int in = first ? L[first - 1].w.dims[1] : batch->inputs;
+
+	for (int l = first; l < batch->layers; ++l)
+	{
+		const int out = L[l].w.dims[1];
+		float* y = batch->a[l];
+
+		dense(x, batch->count, in, &L[l].w, &L[l].b, y);
+		activate(batch, L + l, y);
+
+		x = y;
+		in = out;
+	}
+
+	return batch->layers ? batch->a[batch->layers - 1] : batch->x;
+}
+
+
+float* batch_predict(batch_t* batch, nn_layer_t* L)
+{
+	return forward(batch, L, 0, batch->x);
+}
+
+
+float* batch_predict_conv(batch_t* batch, nn_layer_t* L, const float* img, int pitch, int seg, const int* corners, int count)
+{
+	if (!batch->layers) return NULL;
+
+	batch->count = count < batch->capacity ? count : batch->capacity;
+
+	conv(img, pitch, seg, corners, batch->count, &L[0].w, &L[0].b, batch->a[0]);
+	activate(batch, L, batch->a[0]);
+
+	return forward(batch, L, 1, batch->a[0]);
+}
+
+
+float* batch_predict_q8(batch_t* batch, const qdense_t* Q, nn_layer_t* L)
+{
+	const int8_t* q = batch->xq;
+	const float* scale = batch->xq_scale;
+	float offset = Q8_PIXEL_OFFSET;
+
+	for (int l = 0; l < batch->layers; ++l)
+	{
+		float* y = batch->a[l];
+
+		qdense_forward(Q + l, q, scale, offset, batch->count, y);
+		activate(batch, L + l, y);
+
+		if (l + 1 < batch->layers)
+		{
+			qdense_quantize_rows(y, batch->count, Q[l].out, batch->hq, batch->hq_scale);
+			q = batch->hq;
+			scale = batch->hq_scale;
+			offset = 0;
+		}
+	}
+
+	return batch->layers ? batch->a[batch->layers - 1] : NULL;
+}
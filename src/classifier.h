@@ -0,0 +1,103 @@
+#ifndef AVC_CLASSIFIER
+#define AVC_CLASSIFIER
+
+#include "nn.h"
+#include "qdense.h"
+
+#define CLASSIFIER_MAX_LAYERS 8
+
+// the model is trained on pixel / 255 - 0.5, int8 rows given to
+// batch_predict_q8() hold pixel - 128 which stands for the same value
+#define Q8_PIXEL_SCALE  (1 / 255.f)
+#define Q8_PIXEL_OFFSET 0.5f
+
+/**
+ * @brief A batch of patches pushed through a stack of dense layers at once.
+ *        Each layer becomes one [n x in] * [in x out] product instead of n
+ *        matrix-vector products.
+ */
+typedef struct {
+	int capacity; // max rows
+	int count;    // rows gathered so far
+	int layers;
+	int inputs;   // features per row
+	int outputs;  // values per row produced by the last layer
+	float* x;     // [capacity x inputs]
+	float* a[CLASSIFIER_MAX_LAYERS]; // [capacity x outputs of layer]
+
+	// quantized path
+	int8_t* xq;      // [capacity x inputs] pixel codes
+	float* xq_scale; // [capacity]
+	int8_t* hq;      // [capacity x widest layer] quantized hidden activations
+	float* hq_scale; // [capacity]
+} batch_t;
+
+/**
+ * @brief Allocates a batch for the network L which must be initialized
+ *        with nn_fc_init() as its per layer outputs are used as templates.
+ * @param batch - batch to initialize
+ * @param L - layers, terminated by an entry without weights
+ * @param capacity - max number of rows
+ * @return 0 on success
+ */
+int batch_init(batch_t* batch, nn_layer_t* L, int capacity);
+
+/**
+ * @brief Releases everything batch_init() allocated.
+ */
+void batch_free(batch_t* batch);
+
+/**
+ * @brief Folds an affine input normalization into a dense layer, so it can
+ *        be given raw values v where it was trained on v * scale + offset.
+ *        Changes the layer's weights and bias in place.
+ */
+void classifier_fold_input(nn_layer_t* layer, float scale, float offset);
+
+/**
+ * @brief Empties the batch without releasing memory.
+ */
+void batch_reset(batch_t* batch);
+
+/**
+ * @brief Returns the next input row to fill, or NULL if the batch is full.
+ */
+float* batch_row(batch_t* batch);
+
+/**
+ * @brief Returns the next int8 input row to fill with pixel codes, or NULL
+ *        if the batch is full. Rows of one batch are either all float or
+ *        all int8.
+ */
+int8_t* batch_row_q8(batch_t* batch);
+
+/**
+ * @brief Runs every gathered row through L.
+ * @return [count x outputs] output of the last layer, row i belongs to the
+ *         i-th call of batch_row()
+ */
+float* batch_predict(batch_t* batch, nn_layer_t* L);
+
+/**
+ * @brief Like batch_predict(), but each row is a patch read in place from
+ *        an image whose channel values are interleaved. The first layer is
+ *        evaluated as a convolution so overlapping patches are never copied
+ *        into rows. Replaces whatever rows were gathered.
+ * @param img - image the patches are read from
+ * @param pitch - floats per image row
+ * @param seg - floats per patch row, the layer's inputs are a whole number of them
+ * @param corners - [count] offset of each patch's top left value in img
+ * @param count - number of patches, at most the batch's capacity
+ * @return same as batch_predict()
+ */
+float* batch_predict_conv(batch_t* batch, nn_layer_t* L, const float* img, int pitch, int seg, const int* corners, int count);
+
+/**
+ * @brief Runs every gathered int8 row through the quantized layers Q, one
+ *        per layer of L. Hidden activations are requantized per row, L only
+ *        supplies the activation functions.
+ * @return same as batch_predict()
+ */
+float* batch_predict_q8(batch_t* batch, const qdense_t* Q, nn_layer_t* L);
+
+#endif
@@ -19,6 +19,11 @@ int NORM_VIDEO;
 int WAIT_FOR_MOVEMENT = 1;
 int READ_ACTION = 1;
 int FRAME_RATE = 30;
+int CAM_BUFFERS = CAM_BUFFERS_DEFAULT;
+int CAP_W = FRAME_W, CAP_H = FRAME_H;
+cam_rect_t CAP_CROP;
+const char* CAM_PATHS[VIEWS_MAX];
+int CAM_COUNT;
 char* MEDIA_PATH;
 calib_t CAL;
 col_mode_t MODE;
@@ -26,6 +31,33 @@ float VEL;
 pthread_mutex_t STATE_LOCK;
 
 
+// one of the cameras after the first, captured on its own thread
+typedef struct {
+	cam_t cam;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t fresh;
+	view_t frames[2];     // the two newest frames
+	uint64_t frame_us[2]; // and when they were captured
+	int newest;           // index into frames, -1 before the first
+} view_capture_t;
+
+view_capture_t VIEW_CAPS[VIEWS_MAX - 1];
+
+
+static int arg_add_camera(char flag, const char* path)
+{
+	if (CAM_COUNT >= VIEWS_MAX)
+	{
+		b_bad("At most %d cameras are supported", VIEWS_MAX);
+		exit(-1);
+	}
+
+	CAM_PATHS[CAM_COUNT++] = strdup(path);
+	return 0;
+}
+
+
 static int arg_calibration_mode(char flag, const char* v)
 {
 	MODE = COL_MODE_ACT_CAL;
@@ -34,6 +66,32 @@ static int arg_calibration_mode(char flag, const char* v)
 }
 
 
+static int arg_frame_size(char flag, const char* v)
+{
+	if (sscanf(v, "%dx%d", &CAP_W, &CAP_H) != 2 || CAP_W < 2 || CAP_W > FRAME_W || CAP_H < 1 || CAP_H > FRAME_H)
+	{
+		b_bad("Frames are WxH, at most %dx%d", FRAME_W, FRAME_H);
+		exit(-1);
+	}
+
+	return 0;
+}
+
+
+static int arg_crop(char flag, const char* v)
+{
+	cam_rect_t* r = &CAP_CROP;
+
+	if (sscanf(v, "%dx%d+%d+%d", &r->width, &r->height, &r->left, &r->top) != 4 || r->width < 1 || r->height < 1)
+	{
+		b_bad("The crop is WxH+left+top in sensor pixels");
+		exit(-1);
+	}
+
+	return 0;
+}
+
+
 static int arg_immediate_start(char flag, const char* v)
 {
 	WAIT_FOR_MOVEMENT = 0;
@@ -73,14 +131,72 @@ void proc_opts(int argc, char* const argv[])
 		},
 		{ 'f',
 			.desc = "set framerate in frames/second",
+			.usage = "-f [fps]",
+			.opts = { .has_value = 1 },
 			.set = &FRAME_RATE,
 			.type = ARG_TYP_INT
 		},
+		{ 'v',
+			.desc = "Camera to capture from, repeat for more. The first one's frames are the state's view, defaults to /dev/video0",
+			.usage = "-v [device]",
+			.opts = { .has_value = 1 },
+			.set = arg_add_camera,
+			.type = ARG_TYP_CALLBACK
+		},
+		{ 's',
+			.desc = "Frame size to capture, the camera scales down to the nearest it supports. At most and defaults to 352x240",
+			.usage = "-s [WxH]",
+			.opts = { .has_value = 1 },
+			.set = arg_frame_size,
+			.type = ARG_TYP_CALLBACK
+		},
+		{ 'C',
+			.desc = "Area of the sensor to capture, before scaling to the frame size",
+			.usage = "-C [WxH+left+top]",
+			.opts = { .has_value = 1 },
+			.set = arg_crop,
+			.type = ARG_TYP_CALLBACK
+		},
+		{ 'b',
+			.desc = "Number of buffers the camera captures into, 2 to 8, defaults to 4",
+			.usage = "-b [buffers]",
+			.opts = { .has_value = 1 },
+			.set = &CAM_BUFFERS,
+			.type = ARG_TYP_INT
+		},
 		{} // terminator
 	};
 
 	cli("Collects data from sensors, compiles them into system state packets. Then forwards them over stdout",
 	cmds, argc, argv);
+
+	if (CAM_BUFFERS < CAM_BUFFERS_MIN || CAM_BUFFERS > CAM_BUFFERS_MAX)
+	{
+		b_bad("The camera needs %d to %d buffers", CAM_BUFFERS_MIN, CAM_BUFFERS_MAX);
+		exit(-1);
+	}
+}
+
+/**
+ * @brief Splits the frame the camera last dequeued into the top left of
+ *        view, whose rows are FRAME_W pixels apart.
+ */
+static void unpack_frame(const cam_t* cam, view_t* view)
+{
+	const uint8_t* yuyv = (const uint8_t*)cam->frame_buffers[cam->held];
+
+	// rows are contiguous in both the buffer and the view, so the frame
+	// is split in one go
+	if (cam->width == FRAME_W && cam->pitch == FRAME_W * 2)
+	{
+		yuyv_unpack(yuyv, view->luma, view->chroma, FRAME_W * cam->height);
+		return;
+	}
+
+	for (int r = 0; r < cam->height; ++r)
+	{
+		yuyv_unpack(yuyv + r * cam->pitch, view->luma + r * FRAME_W, view->chroma + r * (FRAME_W / 2), cam->width);
+	}
 }
 
 /**
@@ -91,41 +207,108 @@ void proc_opts(int argc, char* const argv[])
  */
 int poll_vision(raw_state_t* state, cam_t* cams)
 {
-	cam_wait_frame(cams);
+	if (cam_wait_frame(cams)) return -1;
 
-	range_t luma_range = { 128, 128 };
-	range_t cr_range = { 128, 128 };
-	range_t cb_range = { 128, 128 };
-	float luma_mu = 0;
-	float cr_mu = 0;
-	float cb_mu = 0;
+	unpack_frame(cams, &state->view);
 
-	raw_state_t new_frame = {};
+	// hand the buffer straight back so the driver always has every
+	// other one to capture into
+	return cam_request_frame(cams) ? -2 : 0;
+}
 
-	// Downsample the intensity resolution to match that of
-	// the chroma
-	for (int j = FRAME_H; j--;)
-	{
-		int bi = cams[0].buffer_info.index;
-		uint32_t* row = cams[0].frame_buffers[bi] + (j * (FRAME_W << 1));
-		uint8_t* luma_row = state->view.luma + (j * FRAME_W);
-		chroma_t* chroma_row = state->view.chroma + (j * (FRAME_W >> 1));
+/**
+ * @brief Captures frames from one of the extra cameras, keeping the two
+ *        newest for collection() to pair with the first camera's.
+ * @param params - the camera's view_capture_t
+ */
+static void* view_capture(void* params)
+{
+	view_capture_t* vc = (view_capture_t*)params;
 
-		for (int i = FRAME_W / 2; i--;)
+	for (;;)
+	{
+		if (cam_wait_frame(&vc->cam))
 		{
-			int li = i << 1;
+			b_bad("Error capturing frame");
+			exit(-2);
+		}
 
-			luma_row[li + 0] = row[i] & 0xFF;
-			luma_row[li + 1] = (row[i] >> 16) & 0xFF;
+		pthread_mutex_lock(&vc->lock);
+		int slot = vc->newest < 0 ? 0 : vc->newest ^ 1;
+		unpack_frame(&vc->cam, vc->frames + slot);
+		vc->frame_us[slot] = cam_frame_us(&vc->cam);
+		vc->newest = slot;
+		pthread_cond_broadcast(&vc->fresh);
+		pthread_mutex_unlock(&vc->lock);
 
-			chroma_row[i].cr = (row[i] >> 8) & 0xFF;
-			chroma_row[i].cb = (row[i] >> 24) & 0xFF;
+		cam_request_frame(&vc->cam);
+	}
 
-		}
+	return NULL;
+}
+
+
+/**
+ * @brief Starts capturing from an extra camera on its own thread.
+ * @return 0 on success
+ */
+static int view_capture_start(view_capture_t* vc)
+{
+	pthread_condattr_t attr;
+
+	vc->newest = -1;
+	pthread_mutex_init(&vc->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&vc->fresh, &attr);
+	pthread_condattr_destroy(&attr);
+
+	return pthread_create(&vc->thread, NULL, view_capture, vc);
+}
+
+
+/**
+ * @brief Copies the extra camera's frame captured closest to capture_us
+ *        into view. If its newest frame is older than capture_us, waits up
+ *        to a frame interval for the next one, which may be closer.
+ * @return capture time of the copied frame relative to capture_us, or
+ *         INT64_MAX if the camera hasn't captured anything yet
+ */
+static int64_t view_pair(view_capture_t* vc, uint64_t capture_us, view_t* view)
+{
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_nsec += 1000000000L / FRAME_RATE;
+	deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+	deadline.tv_nsec %= 1000000000L;
+
+	pthread_mutex_lock(&vc->lock);
+
+	while (vc->newest < 0 || vc->frame_us[vc->newest] < capture_us)
+	{
+		if (pthread_cond_timedwait(&vc->fresh, &vc->lock, &deadline)) break;
+	}
+
+	if (vc->newest < 0)
+	{
+		pthread_mutex_unlock(&vc->lock);
+		return INT64_MAX;
 	}
 
+	int best = vc->newest;
+	int64_t offset = (int64_t)(vc->frame_us[best] - capture_us);
+	int64_t older = (int64_t)(vc->frame_us[best ^ 1] - capture_us);
 
-	return 0;
+	if (vc->frame_us[best ^ 1] && llabs(older) < llabs(offset))
+	{
+		best ^= 1;
+		offset = older;
+	}
+
+	memcpy(view, vc->frames + best, sizeof(view_t));
+	pthread_mutex_unlock(&vc->lock);
+
+	return offset;
 }
 
 /**
@@ -205,17 +388,25 @@ int collection(cam_t* cam)
 {
 	int updates = 0;
 	time_t now;
-	message_t msg = {
-		.header = {
-			.magic = MAGIC,
-			.type  = PAYLOAD_STATE
-		},
-	};
-	raw_state_t* state = &msg.payload.state;
+
+	// every other camera's frame is sent along with the state's
+	const uint16_t fields = FIELD_TELEMETRY | FIELD_VIEW | (CAM_COUNT > 1 ? FIELD_VIEWS : 0);
+	message_t* msg = message_alloc(PAYLOAD_STATE, fields);
+	assert(msg);
+
+	msg->header.fields = fields;
+	msg->header.width = cam->width;
+	msg->header.height = cam->height;
+	raw_state_t* state = &msg->payload.state;
 
 	pthread_mutex_init(&STATE_LOCK, NULL);
 	now = time(NULL);
-	start_pose_thread(&msg);
+	start_pose_thread(msg);
+
+	for (int i = 0; i < CAM_COUNT - 1; ++i)
+	{
+		assert(view_capture_start(VIEW_CAPS + i) == 0);
+	}
 
 	// wait for the bot to start moving
 	if (WAIT_FOR_MOVEMENT)
@@ -226,32 +417,62 @@ int collection(cam_t* cam)
 
 	for (;;)
 	{
-		cam_request_frame(cam);
-
-		// Do something while we wait for our
-		// next frame to come in...
 		++updates;
 		if (now != time(NULL))
 		{
-			b_log("%dHz (%f %f %f) %fm/s",
+			uint64_t dropped = cam->dropped, late = cam->late;
+
+			for (int i = 0; i < CAM_COUNT - 1; ++i)
+			{
+				dropped += VIEW_CAPS[i].cam.dropped;
+				late += VIEW_CAPS[i].cam.late;
+			}
+
+			b_log("%dHz (%f %f %f) %fm/s, %" PRIu64 " frames dropped, %" PRIu64 " late",
 				updates,
 				state->position[0],
 				state->position[1],
 				state->position[2],
-				state->vel
+				state->vel,
+				dropped,
+				late
 			);
 			updates = 0;
 			now = time(NULL);
 		}
 
-		if (poll_vision(state, cam))
+		// with a shared ring downstream the frame is unpacked straight
+		// into the slot it's sent from, instead of being copied there
+		message_t* out = pipeline_claim(fields);
+
+		if (poll_vision(out ? &out->payload.state : state, cam))
 		{
 			b_bad("Error capturing frame");
 			return -2;
 		}
 
+		msg->header.seq++;
+		msg->header.capture_us = cam_frame_us(cam);
+
+		if (CAM_COUNT > 1)
+		{
+			views_t* views = message_views(out ? out : msg);
+
+			views->count = CAM_COUNT - 1;
+			for (int i = 0; i < CAM_COUNT - 1; ++i)
+			{
+				views->offset_us[i] = view_pair(VIEW_CAPS + i, msg->header.capture_us, views->view + i);
+			}
+		}
+
 		pthread_mutex_lock(&STATE_LOCK);
-		if (write_pipeline_payload(&msg))
+		if (out)
+		{ // the pose thread keeps updating the telemetry in msg
+			out->header = msg->header;
+			memcpy(&out->payload.state, state, offsetof(raw_state_t, view));
+		}
+
+		if (write_pipeline_payload(out ? out : msg))
 		{
 			b_bad("Error writing state-action pair");
 			return -3;
@@ -274,18 +495,54 @@ int main(int argc, char* const argv[])
 
 	int res;
 	cam_settings_t cfg = {
-		.width  = 160,
-		.height = 120,
+		.width  = CAP_W,
+		.height = CAP_H,
 		.frame_rate = FRAME_RATE,
+		.buffers = CAM_BUFFERS,
+		.crop = CAP_CROP,
 	};
 
 	b_log("Sensors...");
 
-	cam_t cam[2] = {
-		cam_open("/dev/video0", &cfg),
-		//cam_open("/dev/video1", &cfg),
+	if (!CAM_COUNT)
+	{
+		CAM_PATHS[CAM_COUNT++] = "/dev/video0";
+	}
+
+	cam_t cam[1] = {
+		cam_open(CAM_PATHS[0], &cfg),
 	};
 
+	if (!cam->frame_buffers)
+	{
+		return -1;
+	}
+
+	// the driver may not go as small as asked, but the view can't be outgrown
+	if (cam->width > FRAME_W || cam->height > FRAME_H)
+	{
+		b_bad("'%s' captures %dx%d frames, larger than %dx%d", CAM_PATHS[0], cam->width, cam->height, FRAME_W, FRAME_H);
+		return -1;
+	}
+
+	for (int i = 1; i < CAM_COUNT; ++i)
+	{
+		// every view shares the header's frame size, so ask for the first's
+		cam_settings_t view_cfg = cfg;
+		VIEW_CAPS[i - 1].cam = cam_open(CAM_PATHS[i], &view_cfg);
+
+		if (!VIEW_CAPS[i - 1].cam.frame_buffers)
+		{
+			return -1;
+		}
+
+		if (view_cfg.width != cam->width || view_cfg.height != cam->height)
+		{
+			b_bad("'%s' captures %dx%d frames, unlike the first camera", CAM_PATHS[i], view_cfg.width, view_cfg.height);
+			return -1;
+		}
+	}
+
 
 	if ((res = i2c_init("/dev/i2c-1")))
 	{
@@ -26,7 +26,7 @@ void* pose_estimator(void* params)
 #warning "Using CPU affinity"
 	// Run exclusively on the 4th core
 	cpu_set_t* pose_cpu = CPU_ALLOC(1);
-	CPU_SET(3, pose_cpu);
+	CPU_SET(POSE_CPU, pose_cpu);
 	size_t pose_cpu_size = CPU_ALLOC_SIZE(1);
 	assert(sched_setaffinity(0, pose_cpu_size, pose_cpu) == 0);
 #endif
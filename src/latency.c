@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include "sys.h"
+#include "structs.h"
+
+// most recent samples kept per stage
+#define MAX_SAMPLES 4096
+#define HIST_BINS 12
+
+typedef struct {
+	uint32_t samples[MAX_SAMPLES];
+	size_t count;
+} samples_t;
+
+typedef struct {
+	char name[16];
+	samples_t total; // capture to stage exit
+	samples_t own;   // previous stage's exit to this stage's exit
+} stage_t;
+
+stage_t STAGES[TRACE_STAGES];
+int STAGE_COUNT;
+int INTERVAL;
+
+struct {
+	uint64_t messages;
+	uint64_t untraced;
+	uint64_t gaps;
+	uint64_t missing;
+} COUNTS;
+
+
+static void sample_add(samples_t* s, int64_t us)
+{
+	s->samples[s->count++ % MAX_SAMPLES] = us < 0 ? 0 : us;
+}
+
+
+static int cmp_u32(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+
+static void print_samples(const char* name, const char* kind, samples_t* s)
+{
+	size_t n = MIN(s->count, MAX_SAMPLES);
+	uint32_t sorted[MAX_SAMPLES];
+	int bins[HIST_BINS] = {};
+
+	if (!n) return;
+
+	memcpy(sorted, s->samples, n * sizeof(uint32_t));
+	qsort(sorted, n, sizeof(uint32_t), cmp_u32);
+
+	printf("%-16s %-6s p50 %7.2fms  p99 %7.2fms  max %7.2fms  |",
+		name,
+		kind,
+		sorted[n / 2] / 1000.f,
+		sorted[(n * 99) / 100] / 1000.f,
+		sorted[n - 1] / 1000.f
+	);
+
+	// power of two bins, the first is < 1ms the last catches everything else
+	for (int i = n; i--;)
+	{
+		int bin = 0;
+		for (uint32_t ms = sorted[i] / 1000; ms && bin < HIST_BINS - 1; ms >>= 1) ++bin;
+		bins[bin]++;
+	}
+
+	for (int i = 0; i < HIST_BINS; ++i)
+	{
+		printf(" %d", bins[i]);
+	}
+
+	printf("\n");
+}
+
+
+static void report(void)
+{
+	printf("%" PRIu64 " messages, %" PRIu64 " untraced, %" PRIu64 " sequence gaps (%" PRIu64 " frames missing)\n",
+		COUNTS.messages,
+		COUNTS.untraced,
+		COUNTS.gaps,
+		COUNTS.missing
+	);
+
+	printf("histogram bins: <1ms, <2ms, <4ms ... >=%dms\n", 1 << (HIST_BINS - 2));
+
+	for (int i = 0; i < STAGE_COUNT; ++i)
+	{
+		print_samples(STAGES[i].name, "total", &STAGES[i].total);
+		print_samples(STAGES[i].name, "stage", &STAGES[i].own);
+	}
+
+	fflush(stdout);
+}
+
+
+void sig_handler(int sig)
+{
+	report();
+	exit(0);
+}
+
+
+int main(int argc, char* const argv[])
+{
+	PROC_NAME = argv[0];
+	signal(SIGINT, sig_handler);
+
+	cli_cmd_t cmds[] = {
+		{ 'i',
+			.desc = "Print a report every N seconds, as well as at exit",
+			.usage = "-i [seconds]",
+			.opts = { .has_value = 1 },
+			.set = &INTERVAL,
+			.type = ARG_TYP_INT,
+		},
+		{}
+	};
+
+	if (cli("Reads a traced stream (AVC_TRACE=1) over stdin and reports the latency\n"
+	        "of each stage from capture, along with gaps in sequence numbers", cmds, argc, argv))
+	{
+		return -1;
+	}
+
+	// only the header and trace are of interest
+	message_t* msg = message_alloc(PAYLOAD_PAIR, FIELD_TRACE);
+	uint32_t last_seq = 0;
+	time_t last_report = time(NULL);
+	int res;
+
+	assert(msg);
+
+	while ((res = read_pipeline_fields(msg, PAYLOAD_PAIR, FIELD_TRACE)) == PIPE_OK)
+	{
+		dataset_hdr_t* hdr = &msg->header;
+		trace_t* trace = &msg->payload.trace;
+
+		if (COUNTS.messages++ && hdr->seq > last_seq + 1)
+		{
+			COUNTS.gaps++;
+			COUNTS.missing += hdr->seq - last_seq - 1;
+		}
+		last_seq = hdr->seq;
+
+		if (!(hdr->fields & FIELD_TRACE) || !hdr->capture_us)
+		{
+			COUNTS.untraced++;
+			continue;
+		}
+
+		uint64_t last_exit = hdr->capture_us;
+		for (int i = 0; i < MIN(trace->count, TRACE_STAGES); ++i)
+		{
+			stage_stamp_t* stamp = trace->stages + i;
+			stage_t* stage = STAGES + i;
+
+			if (i >= STAGE_COUNT)
+			{
+				memcpy(stage->name, stamp->name, sizeof(stage->name));
+				stage->name[sizeof(stage->name) - 1] = '\0';
+				STAGE_COUNT = i + 1;
+			}
+
+			sample_add(&stage->total, (int64_t)(stamp->exit_us - hdr->capture_us));
+			sample_add(&stage->own, (int64_t)(stamp->exit_us - last_exit));
+			last_exit = stamp->exit_us;
+		}
+
+		if (INTERVAL > 0 && time(NULL) - last_report >= INTERVAL)
+		{
+			report();
+			last_report = time(NULL);
+		}
+	}
+
+	if (res != PIPE_EOF)
+	{
+		b_bad("read error (%d)", res);
+	}
+
+	report();
+
+	return res == PIPE_EOF ? 0 : -1;
+}
@@ -0,0 +1,184 @@
+#include <errno.h>
+
+#include "sys.h"
+#include "model.h"
+
+
+static int layer_from_file(model_t* model, const model_layer_t* desc, int index)
+{
+	const uint64_t w_bytes = (uint64_t)desc->in * desc->out * sizeof(float);
+	const uint64_t b_bytes = (uint64_t)desc->out * sizeof(float);
+	nn_layer_t* layer = model->L + index;
+
+	if (desc->w_off % MODEL_ALIGN || desc->b_off % MODEL_ALIGN) return -1;
+	if (desc->w_off + w_bytes > model->size || desc->b_off + b_bytes > model->size) return -2;
+	if (index && desc->in != (uint32_t)model->L[index - 1].w.dims[1]) return -3;
+
+	switch (desc->activation)
+	{
+		case MODEL_ACT_RELU:
+			layer->activation = nn_act_relu;
+			break;
+		case MODEL_ACT_SOFTMAX:
+			layer->activation = nn_act_softmax;
+			break;
+		default:
+			return -4;
+	}
+
+	layer->w.dims[0] = desc->in;
+	layer->w.dims[1] = desc->out;
+	layer->w.data.f = (float*)((uint8_t*)model->map + desc->w_off);
+	layer->b.dims[0] = 1;
+	layer->b.dims[1] = desc->out;
+	layer->b.data.f = (float*)((uint8_t*)model->map + desc->b_off);
+
+	return 0;
+}
+
+
+int model_map(model_t* model, const char* path)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	memset(model, 0, sizeof(model_t));
+
+	if (fd < 0) return -1;
+
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(model_hdr_t))
+	{
+		b_bad("'%s' is not a packed model", path);
+		close(fd);
+		return -2;
+	}
+
+	// private and writable so the input normalization can still be folded
+	// into the first layer, only the pages that touches get copied
+	void* mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (mem == MAP_FAILED)
+	{
+		b_bad("Couldn't map '%s' (%d)", path, errno);
+		return -3;
+	}
+
+	model->map = mem;
+	model->size = st.st_size;
+
+	const model_hdr_t* hdr = (const model_hdr_t*)mem;
+	const model_layer_t* descs = (const model_layer_t*)(hdr + 1);
+
+	if (hdr->magic != MODEL_MAGIC || hdr->version != MODEL_VERSION)
+	{
+		b_bad("'%s' is not a packed model (version %d)", path, MODEL_VERSION);
+		goto fail;
+	}
+
+	if (hdr->size != model->size || !hdr->layers || hdr->layers > MODEL_MAX_LAYERS ||
+	    sizeof(model_hdr_t) + hdr->layers * sizeof(model_layer_t) > model->size)
+	{
+		b_bad("'%s' is truncated or has %u layers", path, hdr->layers);
+		goto fail;
+	}
+
+	for (uint32_t i = 0; i < hdr->layers; ++i)
+	{
+		int res = layer_from_file(model, descs + i, i);
+
+		if (res)
+		{
+			b_bad("'%s' layer %u is malformed (%d)", path, i, res);
+			goto fail;
+		}
+	}
+
+	model->layers = hdr->layers;
+	model->input_scale = hdr->input_scale;
+	model->input_offset = hdr->input_offset;
+
+	return 0;
+
+fail:
+	munmap(mem, model->size);
+	memset(model, 0, sizeof(model_t));
+	return -4;
+}
+
+
+int model_load(model_t* model, const char* dir)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/" MODEL_FILE, dir);
+
+	if (access(path, F_OK) == 0)
+	{
+		return model_map(model, path);
+	}
+
+	// fall back to one file per tensor
+	const char* names[] = { "dense", "dense_1" };
+	const nn_layer_t layers[] = {
+		{ .activation = nn_act_relu },
+		{ .activation = nn_act_softmax },
+	};
+
+	memset(model, 0, sizeof(model_t));
+
+	for (int i = 0; i < 2; ++i)
+	{
+		nn_layer_t* layer = model->L + i;
+
+		*layer = layers[i];
+		snprintf(path, sizeof(path), "%s/%s.kernel", dir, names[i]);
+		layer->w = nn_mat_load(path);
+		snprintf(path, sizeof(path), "%s/%s.bias", dir, names[i]);
+		layer->b = nn_mat_load(path);
+
+		if (!layer->w.data.f || !layer->b.data.f)
+		{
+			b_bad("Couldn't load layer '%s' from '%s'", names[i], dir);
+			model->layers = i + 1;
+			model_release(model);
+			return -1;
+		}
+	}
+
+	// trainer.py's tensors expect pixel / 255 - 0.5
+	model->layers = 2;
+	model->input_scale = 1 / 255.f;
+	model->input_offset = -0.5f;
+
+	return 0;
+}
+
+
+void model_release(model_t* model)
+{
+	// nn.h allocates its matrices with malloc
+	for (int i = 0; i < model->layers; ++i)
+	{
+		nn_layer_t* layer = model->L + i;
+
+		if (layer->A)
+		{
+			free(layer->A->data.f);
+			free(layer->A);
+		}
+
+		if (!model->map)
+		{
+			free(layer->w.data.f);
+			free(layer->b.data.f);
+		}
+	}
+
+	if (model->map)
+	{
+		munmap(model->map, model->size);
+	}
+
+	memset(model, 0, sizeof(model_t));
+}
@@ -0,0 +1,75 @@
+#ifndef AVC_MODEL
+#define AVC_MODEL
+
+#include <inttypes.h>
+#include "nn.h"
+
+#define MODEL_MAGIC   0x4D445641 // 'AVDM'
+#define MODEL_VERSION 1
+#define MODEL_ALIGN   64
+#define MODEL_FILE    "model.avm"
+#define MODEL_MAX_LAYERS 8
+
+enum {
+	MODEL_ACT_RELU = 1,
+	MODEL_ACT_SOFTMAX,
+};
+
+/**
+ * @brief Header of a packed model file, as written by ml/pack.py. It is
+ *        followed by one model_layer_t per layer, then the tensors, each
+ *        starting on a MODEL_ALIGN boundary. All values are little endian.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t layers;
+	uint32_t reserved;
+	float input_scale;  // normalization the first layer expects, applied
+	float input_offset; // to raw pixel values as v * scale + offset
+	uint64_t size;      // of the whole file
+} model_hdr_t;
+
+/**
+ * @brief Topology of one dense layer in a packed model file. Offsets are
+ *        from the start of the file, weights are float [in][out] and
+ *        biases float [out].
+ */
+typedef struct {
+	uint32_t in, out;
+	uint32_t activation; // MODEL_ACT_*
+	uint32_t reserved;
+	uint64_t w_off, b_off;
+} model_layer_t;
+
+typedef struct {
+	nn_layer_t L[MODEL_MAX_LAYERS + 1]; // terminated by an empty layer
+	int layers;
+	float input_scale, input_offset;
+	void* map;   // NULL when loaded from separate tensor files
+	size_t size;
+} model_t;
+
+/**
+ * @brief Maps a packed model file, the layers' weights point into the
+ *        mapping so nothing is copied or parsed. Pages nobody writes to
+ *        are shared with every other process mapping the same file.
+ * @return 0 on success
+ */
+int model_map(model_t* model, const char* path);
+
+/**
+ * @brief Loads the model in dir, from MODEL_FILE if it exists, otherwise
+ *        from the separate dense.kernel, dense.bias... files trainer.py
+ *        exports.
+ * @return 0 on success
+ */
+int model_load(model_t* model, const char* dir);
+
+/**
+ * @brief Unmaps or frees the model's tensors, along with the layer outputs
+ *        nn_fc_init() allocated for it.
+ */
+void model_release(model_t* model);
+
+#endif
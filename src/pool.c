@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+#include <sched.h>
+
+#include "sys.h"
+#include "pool.h"
+
+typedef struct {
+	pool_t* pool;
+	int index;
+} worker_arg_t;
+
+
+static void pool_pin(int reserved_cpu)
+{
+#ifdef __linux__
+	int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (reserved_cpu < 0 || reserved_cpu >= cpus || cpus < 2) return;
+
+	cpu_set_t* set = CPU_ALLOC(cpus);
+	size_t set_size = CPU_ALLOC_SIZE(cpus);
+
+	CPU_ZERO_S(set_size, set);
+	for (int i = cpus; i--;)
+	{
+		if (i != reserved_cpu) CPU_SET_S(i, set_size, set);
+	}
+
+	if (sched_setaffinity(0, set_size, set))
+	{
+		b_bad("Couldn't keep pool off cpu %d", reserved_cpu);
+	}
+
+	CPU_FREE(set);
+#endif
+}
+
+
+// called with the lock held, claims and runs jobs until none are left
+static void pool_work(pool_t* pool, int worker)
+{
+	while (pool->next < pool->jobs)
+	{
+		int job = pool->next++;
+
+		pthread_mutex_unlock(&pool->lock);
+		pool->fn(pool->ctx, job, worker);
+		pthread_mutex_lock(&pool->lock);
+
+		if (--pool->pending == 0)
+		{
+			pthread_cond_signal(&pool->done);
+		}
+	}
+}
+
+
+static void* pool_worker(void* params)
+{
+	worker_arg_t* arg = (worker_arg_t*)params;
+	pool_t* pool = arg->pool;
+	unsigned seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1)
+	{
+		while (pool->generation == seen)
+		{
+			pthread_cond_wait(&pool->start, &pool->lock);
+		}
+
+		seen = pool->generation;
+		pool_work(pool, arg->index);
+	}
+
+	return NULL;
+}
+
+
+int pool_init(pool_t* pool, int workers, int reserved_cpu)
+{
+	memset(pool, 0, sizeof(pool_t));
+
+	if (workers <= 0)
+	{
+		int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = cpus > 1 && reserved_cpu >= 0 && reserved_cpu < cpus ? cpus - 1 : cpus;
+	}
+
+	pool->workers = workers < 1 ? 1 : workers;
+	pool->threads = (pthread_t*)calloc(pool->workers, sizeof(pthread_t));
+	worker_arg_t* args = (worker_arg_t*)calloc(pool->workers, sizeof(worker_arg_t));
+
+	if (!pool->threads || !args) return -1;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	// threads inherit the caller's affinity
+	pool_pin(reserved_cpu);
+
+	// the caller is the last worker
+	pool->threads[pool->workers - 1] = pthread_self();
+	for (int i = 0; i < pool->workers - 1; ++i)
+	{
+		args[i].pool = pool;
+		args[i].index = i;
+
+		if (pthread_create(pool->threads + i, NULL, pool_worker, args + i))
+		{
+			b_bad("Couldn't start pool worker %d", i);
+			return -2;
+		}
+	}
+
+	return 0;
+}
+
+
+void pool_run(pool_t* pool, pool_job_fn fn, void* ctx, int jobs)
+{
+	pthread_mutex_lock(&pool->lock);
+
+	pool->fn = fn;
+	pool->ctx = ctx;
+	pool->jobs = jobs;
+	pool->next = 0;
+	pool->pending = jobs;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+
+	pool_work(pool, pool->workers - 1);
+
+	while (pool->pending)
+	{
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+}
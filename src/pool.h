@@ -0,0 +1,45 @@
+#ifndef AVC_POOL
+#define AVC_POOL
+
+#include <pthread.h>
+
+/**
+ * @brief Work function run by the pool.
+ * @param ctx - context given to pool_run()
+ * @param job - index of the job, 0 to jobs - 1
+ * @param worker - index of the thread running it, 0 to workers - 1. Use it
+ *                 to pick per thread buffers.
+ */
+typedef void (*pool_job_fn)(void* ctx, int job, int worker);
+
+typedef struct {
+	int workers; // threads including the caller of pool_run()
+	pthread_t* threads;
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	unsigned generation;
+
+	pool_job_fn fn;
+	void* ctx;
+	int jobs;
+	int next;    // first job not yet claimed
+	int pending; // jobs not yet finished
+} pool_t;
+
+/**
+ * @brief Starts workers - 1 threads, the caller of pool_run() is the last
+ *        one. Every thread of the pool, the caller included, is kept off
+ *        'reserved_cpu' if there are other cores to run on.
+ * @param pool - pool to initialize
+ * @param workers - number of threads, <= 0 for one per usable core
+ * @param reserved_cpu - core left to another process, -1 for none
+ * @return 0 on success
+ */
+int pool_init(pool_t* pool, int workers, int reserved_cpu);
+
+/**
+ * @brief Runs fn for every job on the pool and returns once all finished.
+ */
+void pool_run(pool_t* pool, pool_job_fn fn, void* ctx, int jobs);
+
+#endif
@@ -1,170 +1,507 @@
 #include <dirent.h>
+#include <sys/inotify.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include "sys.h"
 #include "structs.h"
 
 #include "nn.h"
-
-#define ROOT_MODEL_DIR "/var/model/"
+#include "classifier.h"
+#include "pool.h"
+#include "spsc.h"
+#include "model.h"
+#include "window.h"
+#include "route.h"
+#include "pid.h"
+
+// messages in flight between the reader, inference and writer stages
+#define MSG_BUFFERS 4
+#define QUEUE_SIZE 8
 
 int INPUT_FD = 0;
 
-waypoint_t* WAYPOINTS;
-waypoint_t* NEXT_WPT;
+route_t ROUTE;
+int NEXT_WPT = -1; // index into ROUTE, -1 for none
 
 int FORWARD_STATE = 0;
 int USE_DEADRECKONING = 0;
-
-mat_t X;
-nn_layer_t* L;
+int ROUTE_WEIGHT = 50; // percent of the steering taken from the route
+
+// pure pursuit of a point this far ahead on the route
+#define LOOKAHEAD_M   1.0f
+#define WHEELBASE_M   0.26f
+#define MAX_STEER_RAD 0.44f // wheel angle at full lock
+
+PID_t SPEED_PID = { .p = 0.2f, .i = 0.01f };
+int LATEST_ONLY = 0;
+
+int THREADS = 0;
+int QUANTIZED = 0;
+char* MODEL_DIR = "/var/model";
+
+// after a change in the model dir, wait this long for the rest to land
+#define MODEL_SETTLE_MS 250
+
+// everything built from one version of the model, replaced as a whole
+typedef struct {
+	model_t model;
+	mat_t X;
+	qdense_t QL[2];       // int8 versions of the layers, used with -q
+	batch_t* batches;     // one per pool worker
+	uint64_t noticed_us;  // when the change it was loaded for was seen
+} net_t;
+
+// NET is only touched by inference between frames, NEXT_NET is handed
+// over from the watcher
+net_t* NET;
+net_t* NEXT_NET;
+int RELOAD_PIPE[2];
+
+// free: writer -> reader, in: reader -> inference, out: inference -> writer
+// recycle: frames inference skipped in latest mode -> reader
+spsc_t FREE_Q, IN_Q, OUT_Q, RECYCLE_Q;
+int READ_RES;
+uint64_t SKIPPED;
 
 float TOTAL_DISTANCE;
 
 static int arg_load_route(char flag, const char* path)
 {
-	// Load the route
-	int fd = open(path, O_RDONLY);
-	if (fd < 0)
+	if (route_load(&ROUTE, path)) exit(-1);
+
+	NEXT_WPT = 0;
+
+	return 0;
+}
+
+// the frame is split into HIST_W columns of BUCKET_SIZE pixels to steer by
+#define HIST_MAX (FRAME_W / 2)
+int BUCKET_SIZE = 32;
+int HIST_W, HIST_MID;
+#define PATCH_SIZE 16
+#define PATCH_ROW_START 70 // in FRAME_H rows, scaled to the frames' height
+#define PATCH_ROWS 64
+
+pool_t POOL;
+int PATCHES_PER_COLUMN;
+int PATCHES_MAX; // entries in the patch cache, enough for the largest frame
+
+// size of the frames in the view, set from the stream by avoider_resize()
+int VIEW_W, VIEW_H;
+int ROW_START;
+
+// dense class map mode, a patch every MAP_STRIDE pixels over the region
+#define MAP_H (PATCH_ROWS + PATCH_SIZE)
+int MAP_STRIDE;
+int MAP_COLS, MAP_ROWS;
+float* MAP_RGB;     // [MAP_H][VIEW_W * 3] the region, converted once a frame
+int* MAP_CORNERS;   // [cells] offset of each cell's patch in MAP_RGB
+int* MAP_DIRTY_CORNERS; // [cells] the corners of the cells in DIRTY
+float* MAP_SCORE;   // [cells]
+float* MAP_CONF;    // [cells]
+
+// temporal reuse, a patch is only classified again once its luma moved
+// away from what it was last classified on, or it got too old
+int REUSE_MAD = 0;      // mean absolute luma difference, 0 disables reuse
+int REUSE_MAX_AGE = 15; // frames
+uint64_t REUSED, CLASSIFIED;
+
+typedef struct {
+	uint8_t luma[PATCH_SIZE * PATCH_SIZE]; // when last classified
+	float y[3];
+	int age;
+	int valid;
+} patch_cache_t;
+
+patch_cache_t* CACHE; // one per patch, columns' then map cells'
+int* DIRTY;           // one per patch, jobs use the entries of their patches
+
+typedef struct {
+	raw_state_t* state;
+	int jobs;
+	float hist[HIST_MAX];
+	float col_conf[HIST_MAX];
+} avoider_frame_t;
+
+
+// fits the columns and the map to w x h frames. Everything is allocated
+// for the largest frame up front, so this only moves the patches
+static int avoider_resize(int w, int h)
+{
+	if (w < MAX(BUCKET_SIZE, PATCH_SIZE) || h < MAP_H)
 	{
-		b_log("Loading route: '%s' failed", optarg);
-		exit(-1);
+		b_bad("%dx%d frames are too small to classify", w, h);
+		return -1;
 	}
 
-	off_t all_bytes = lseek(fd, 0, SEEK_END);
-	size_t count = all_bytes / sizeof(waypoint_t);
+	VIEW_W = w;
+	VIEW_H = h;
+	HIST_W = w / BUCKET_SIZE;
+	HIST_MID = HIST_W >> 1;
 
-	b_log("Loading route with %d waypoints", count);
+	// the same part of the scene, as long as all the patches still fit
+	ROW_START = MIN(PATCH_ROW_START * h / FRAME_H, h - MAP_H);
 
-	lseek(fd, 0, SEEK_SET);
-	WAYPOINTS = (waypoint_t*)calloc(count + 1, sizeof(waypoint_t));
-	size_t read_bytes = read(fd, WAYPOINTS, count * sizeof(waypoint_t));
-	if (read_bytes != count * sizeof(waypoint_t))
+	if (MAP_STRIDE)
 	{
-		b_log("route read of %d/%dB failed", read_bytes, all_bytes);
-		exit(-1);
+		MAP_COLS = (w - PATCH_SIZE) / MAP_STRIDE + 1;
+
+		for (int i = 0; i < MAP_COLS * MAP_ROWS; ++i)
+		{
+			MAP_CORNERS[i] = ((i / MAP_COLS) * w + (i % MAP_COLS)) * MAP_STRIDE * 3;
+		}
+	}
+
+	// nothing cached was classified where the patches are now
+	memset(CACHE, 0, PATCHES_MAX * sizeof(patch_cache_t));
+
+	return 0;
+}
+
+
+static void avoider_init(void)
+{
+	HIST_W = FRAME_W / BUCKET_SIZE;
+	HIST_MID = HIST_W >> 1;
+
+	// patches sit at rows 0, 1, 3, 7... from the start, see avoider_columns()
+	for (int r = 0, r_stride = 1; r < PATCH_ROWS; r += r_stride, r_stride *= 2)
+	{
+		++PATCHES_PER_COLUMN;
 	}
-	close(fd);
 
-	// connect waypoint references
-	for (int i = 0; i < count - 1; ++i)
+	// stay clear of the collector's pose estimator
+	assert(pool_init(&POOL, THREADS, POSE_CPU) == 0);
+
+	b_log("Classifying on %d threads", POOL.workers);
+
+	if (MAP_STRIDE)
 	{
-		WAYPOINTS[i].next = WAYPOINTS + i + 1;
+		MAP_COLS = (FRAME_W - PATCH_SIZE) / MAP_STRIDE + 1;
+		MAP_ROWS = (MAP_H - PATCH_SIZE) / MAP_STRIDE + 1;
 	}
-	WAYPOINTS[count - 1].next = NULL;
 
-	NEXT_WPT = WAYPOINTS;
+	PATCHES_MAX = MAP_STRIDE ? MAP_COLS * MAP_ROWS : HIST_W * PATCHES_PER_COLUMN;
+	CACHE = (patch_cache_t*)calloc(PATCHES_MAX, sizeof(patch_cache_t));
+	DIRTY = (int*)calloc(PATCHES_MAX, sizeof(int));
+	assert(CACHE && DIRTY);
+
+	if (MAP_STRIDE)
+	{
+		const int cells = MAP_COLS * MAP_ROWS;
+		MAP_RGB = (float*)calloc(MAP_H * FRAME_W * 3, sizeof(float));
+		MAP_CORNERS = (int*)calloc(cells, sizeof(int));
+		MAP_DIRTY_CORNERS = (int*)calloc(cells, sizeof(int));
+		MAP_SCORE = (float*)calloc(cells, sizeof(float));
+		MAP_CONF = (float*)calloc(cells, sizeof(float));
+		assert(MAP_RGB && MAP_CORNERS && MAP_DIRTY_CORNERS && MAP_SCORE && MAP_CONF);
+
+		b_log("Classifying a %dx%d map, one patch every %d pixels", MAP_COLS, MAP_ROWS, MAP_STRIDE);
+	}
+
+	// until the first frame says otherwise
+	assert(avoider_resize(FRAME_W, FRAME_H) == 0);
+}
+
+
+// left edge of the patches sampled for column ci
+static int column_x(int ci)
+{
+	return window_patch_x(ci, BUCKET_SIZE, VIEW_W, PATCH_SIZE);
+}
+
+
+// returns 1 if patch p, whose top left is at (x, y), has to be classified
+// again, otherwise its cached classes are used for one more frame
+static int patch_stale(int p, const uint8_t* luma, int x, int y)
+{
+	patch_cache_t* cache = CACHE + p;
+	const uint32_t limit = REUSE_MAD * PATCH_SIZE * PATCH_SIZE;
+
+	if (!REUSE_MAD || !cache->valid || cache->age >= REUSE_MAX_AGE) return 1;
+	if (yuv_luma_sad(luma + y * FRAME_W + x, FRAME_W, cache->luma, PATCH_SIZE, PATCH_SIZE, PATCH_SIZE) > limit) return 1;
 
+	cache->age++;
 	return 0;
 }
 
-#define BUCKET_SIZE 32
-#define HIST_W (FRAME_W / BUCKET_SIZE)
-#define HIST_MID (HIST_W >> 1)
-void avoider(raw_state_t* state, float* throttle, float* steering)
+
+static void patch_store(int p, const uint8_t* luma, int x, int y, const float* out)
+{
+	patch_cache_t* cache = CACHE + p;
+
+	memcpy(cache->y, out, sizeof(cache->y));
+	cache->age = 0;
+	cache->valid = 1;
+
+	if (!REUSE_MAD) return;
+
+	for (int r = PATCH_SIZE; r--;)
+	{
+		memcpy(cache->luma + r * PATCH_SIZE, luma + (y + r) * FRAME_W + x, PATCH_SIZE);
+	}
+}
+
+
+// colors a w x h block of the frame by the classes in y, for debugging
+static void paint_classes(raw_state_t* state, const float* y, int x, int top, int w, int h)
 {
-	color_t rgb[FRAME_W * FRAME_H];
 	const int CHROMA_W = FRAME_W / 2;
-	time_t now = time(NULL);
-	float hist[HIST_W] = {};
-	float confidence = 0;
-	float col_conf_best = 0;
+	float chroma_v  __attribute__ ((vector_size(8))) = {};
+	float magenta_none __attribute__ ((vector_size(8))) = { 1, 1 };
+	float orange_hay  __attribute__ ((vector_size(8))) = { -1, 1 };
+	float green_asph  __attribute__ ((vector_size(8))) = { -1, -1 };
 
-	yuv422_to_rgb(state->view.luma, state->view.chroma, rgb, FRAME_W, FRAME_H);
+	chroma_v = y[0] * magenta_none + y[1] * orange_hay + y[2] * green_asph;
+	chroma_v = (chroma_v + 1.f) / 2.f;
 
-	for (int ci = 0; ci < HIST_W; ++ci)
+	for (int kr = h; kr--;)
+	for (int kc = w; kc--;)
+	{
+		state->view.chroma[(top + kr) * CHROMA_W + (x + kc) / 2].cr = chroma_v[0] * 255;
+		state->view.chroma[(top + kr) * CHROMA_W + (x + kc) / 2].cb = chroma_v[1] * 255;
+	}
+}
+
+
+// classifies one contiguous range of histogram columns per job
+static void avoider_columns(void* ctx, int job, int worker)
+{
+	avoider_frame_t* frame = (avoider_frame_t*)ctx;
+	raw_state_t* state = frame->state;
+	batch_t* batch = NET->batches + worker;
+	const int start = ROW_START;
+	const int height = PATCH_ROWS;
+	const int ci_first = job * HIST_W / frame->jobs;
+	const int ci_last = (job + 1) * HIST_W / frame->jobs;
+	const uint8_t* luma = state->view.luma;
+	int* dirty = DIRTY + ci_first * PATCHES_PER_COLUMN;
+	int p = ci_first * PATCHES_PER_COLUMN;
+
+	// gather the patches of these columns that changed so they can be
+	// classified in one batch, each is converted from yuv straight into its row
+	batch_reset(batch);
+	for (int ci = ci_first; ci < ci_last; ++ci)
+	for (int r = 0, r_stride = 1; r < height; r += r_stride, r_stride *= 2, ++p)
+	{
+		int c = column_x(ci);
+
+		if (!patch_stale(p, luma, c, r + start)) continue;
+
+		dirty[batch->count] = p;
+
+		if (QUANTIZED)
+		{
+			yuv422_patch_q8(state->view.luma, state->view.chroma, FRAME_W, c, r + start, PATCH_SIZE, batch_row_q8(batch));
+		}
+		else
+		{
+			// raw pixel values, the first layer was folded to expect them
+			yuv422_patch_f(state->view.luma, state->view.chroma, FRAME_W, c, r + start, PATCH_SIZE, batch_row(batch));
+		}
+	}
+
+	if (batch->count)
+	{
+		const float* Y = QUANTIZED ? batch_predict_q8(batch, NET->QL, NET->model.L) : batch_predict(batch, NET->model.L);
+
+		for (int i = 0; i < batch->count; ++i)
+		{
+			int ci = dirty[i] / PATCHES_PER_COLUMN;
+			int r = (1 << (dirty[i] % PATCHES_PER_COLUMN)) - 1;
+			patch_store(dirty[i], luma, column_x(ci), r + start, Y + i * batch->outputs);
+		}
+	}
+
+	__atomic_fetch_add(&CLASSIFIED, batch->count, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&REUSED, (ci_last - ci_first) * PATCHES_PER_COLUMN - batch->count, __ATOMIC_RELAXED);
+
+	p = ci_first * PATCHES_PER_COLUMN;
+	for (int ci = ci_first; ci < ci_last; ++ci)
 	{
 		float col_sum = 0;
-		int c = ci * BUCKET_SIZE;
 
-		const int start = 70;
-		const int height = 64;
 		int r_stride = 1;
 		int samples = 0;
 		float col_conf_sum = 0;
 
 		for (int r = 0; r < height;)
 		{
-			for (int kr = 16; kr--;)
-			for (int kc = 16; kc--;)
-			{
-				color_t color = rgb[((r + start + kr) * FRAME_W) + c + kc];
-				X.data.f[(kr * 48) + kc * 3 + 0] = (color.r / 255.0f) - 0.5f;
-				X.data.f[(kr * 48) + kc * 3 + 1] = (color.g / 255.0f) - 0.5f;
-				X.data.f[(kr * 48) + kc * 3 + 2] = (color.b / 255.0f) - 0.5f;
-			}
+			const float* y = CACHE[p++].y;
+			col_sum += (-(y[0] + y[1]) + (y[2]));
 
-			mat_t y = *nn_predict(L, &X);
-			col_sum += (-(y.data.f[0] + y.data.f[1]) + (y.data.f[2]));
+			++samples;
+			col_conf_sum += y[2];
 
-			if (FORWARD_STATE)
-			for (int kr = r_stride; kr--;)
-			for (int kc = BUCKET_SIZE; kc--;)
-			{
-				float chroma_v  __attribute__ ((vector_size(8))) = {};
-				float magenta_none __attribute__ ((vector_size(8))) = { 1, 1 };
-				float orange_hay  __attribute__ ((vector_size(8))) = { -1, 1 };
-				float green_asph  __attribute__ ((vector_size(8))) = { -1, -1 };
 
-				chroma_v = y.data.f[0] * magenta_none + y.data.f[1] * orange_hay + y.data.f[2] * green_asph;
-				chroma_v = (chroma_v + 1.f) / 2.f;
+			r += r_stride;
+			r_stride *= 2;
+		}
 
-				state->view.chroma[(r + start + kr) * CHROMA_W + (c + kc) / 2].cr = chroma_v[0] * 255;
-				state->view.chroma[(r + start + kr) * CHROMA_W + (c + kc) / 2].cb = chroma_v[1] * 255;
+		frame->hist[ci] = col_sum;
+		frame->col_conf[ci] = col_conf_sum / samples;
+	}
+}
 
-			}
 
-			++samples;
-			col_conf_sum += y.data.f[2];
+// colors each column by the classes of its patches, for debugging. Only
+// once every job is done, patches reach into the next column when it's
+// narrower than they are, or at the right edge
+static void avoider_paint_columns(raw_state_t* state)
+{
+	for (int ci = 0, p = 0; ci < HIST_W; ++ci)
+	for (int r = 0, r_stride = 1; r < PATCH_ROWS; r += r_stride, r_stride *= 2, ++p)
+	{
+		paint_classes(state, CACHE[p].y, ci * BUCKET_SIZE, r + ROW_START, BUCKET_SIZE, r_stride);
+	}
+}
 
 
-			r += r_stride;
-			r_stride *= 2;
+// classifies one contiguous range of map cells per job
+static void avoider_map(void* ctx, int job, int worker)
+{
+	avoider_frame_t* frame = (avoider_frame_t*)ctx;
+	batch_t* batch = NET->batches + worker;
+	const int cells = MAP_COLS * MAP_ROWS;
+	const int first = job * cells / frame->jobs;
+	const int last = (job + 1) * cells / frame->jobs;
+	const int inset = (PATCH_SIZE - MAP_STRIDE) / 2;
+	const uint8_t* luma = frame->state->view.luma;
+	int* dirty = DIRTY + first;
+	int* corners = MAP_DIRTY_CORNERS + first;
+	int count = 0;
+
+	for (int i = first; i < last; ++i)
+	{
+		int x = (i % MAP_COLS) * MAP_STRIDE;
+		int top = ROW_START + (i / MAP_COLS) * MAP_STRIDE;
+
+		if (!patch_stale(i, luma, x, top)) continue;
+
+		dirty[count] = i;
+		corners[count++] = MAP_CORNERS[i];
+	}
+
+	if (count)
+	{
+		const float* Y = batch_predict_conv(batch, NET->model.L, MAP_RGB, VIEW_W * 3, PATCH_SIZE * 3, corners, count);
+
+		for (int j = 0; j < count; ++j)
+		{
+			int i = dirty[j];
+			patch_store(i, luma, (i % MAP_COLS) * MAP_STRIDE, ROW_START + (i / MAP_COLS) * MAP_STRIDE, Y + j * batch->outputs);
 		}
+	}
 
-		float col_conf_avg = col_conf_sum / samples;
-		if (col_conf_avg > col_conf_best) { col_conf_best = col_conf_avg; }
+	__atomic_fetch_add(&CLASSIFIED, count, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&REUSED, last - first - count, __ATOMIC_RELAXED);
 
-		hist[ci] = col_sum;
-		confidence += col_conf_avg;
+	for (int i = first; i < last; ++i)
+	{
+		const float* y = CACHE[i].y;
+
+		MAP_SCORE[i] = -(y[0] + y[1]) + y[2];
+		MAP_CONF[i] = y[2];
+
+		// the stride x stride block around each patch's centre is its own
+		if (FORWARD_STATE)
+		{
+			int x = (i % MAP_COLS) * MAP_STRIDE + inset;
+			int top = ROW_START + (i / MAP_COLS) * MAP_STRIDE + inset;
+			paint_classes(frame->state, y, x, top, MAP_STRIDE, MAP_STRIDE);
+		}
 	}
+}
 
-	confidence /= (float)HIST_W;
 
-	// *confidence /= (float)HIST_W;
+// folds the map's cells into the column histogram by the bucket each
+// patch's centre falls in, a bucket narrower than the stride uses the map
+// column nearest to it. Sums are scaled to the number of patches a
+// column samples otherwise, so the steering scores keep their range.
+static void avoider_map_hist(avoider_frame_t* frame)
+{
+	float conf[HIST_MAX] = {};
+	int count[HIST_MAX] = {};
 
-	float best = hist[HIST_W-1];
-	int cont_r[2] = { HIST_W, HIST_W };
+	memset(frame->hist, 0, sizeof(frame->hist));
 
-	// Here we pick the best, most contigious horizontal range of
-	// the frame with the smallest sum of 'bad' colors, or the
-	// largest sum of good colors if they are present.
-	for (int j = HIST_W + 1; j--;)
+	for (int i = MAP_COLS * MAP_ROWS; i--;)
 	{
-		float cost = 0;
-		int cont_start = j;
+		int ci = MIN(((i % MAP_COLS) * MAP_STRIDE + PATCH_SIZE / 2) / BUCKET_SIZE, HIST_W - 1);
 
-		// From the current column, slide all the way to the left.
-		for (int i = j; i--;)
+		frame->hist[ci] += MAP_SCORE[i];
+		conf[ci] += MAP_CONF[i];
+		count[ci]++;
+	}
+
+	for (int ci = 0; ci < HIST_W; ++ci)
+	{
+		if (!count[ci])
 		{
-			// Accumulate cost for this region
-			cost += hist[i];
-
-			// The score for this region also factors in the width
-			// so as the region grows without accumulating badness
-			// it becomes more attractive. If it is found to have a better
-			// score than the best, then set it as the new best.
-			const float width_weight = 1;
-			float total_cost = cost / (1 + (j - i) * width_weight);
-			if (total_cost > best)
+			int centre = ci * BUCKET_SIZE + BUCKET_SIZE / 2 - PATCH_SIZE / 2;
+			int mc = MAX(0, MIN((centre + MAP_STRIDE / 2) / MAP_STRIDE, MAP_COLS - 1));
+
+			for (int mr = 0; mr < MAP_ROWS; ++mr)
 			{
-				cont_r[0] = i;
-				cont_r[1] = cont_start;
-				best = total_cost;
+				frame->hist[ci] += MAP_SCORE[mr * MAP_COLS + mc];
+				conf[ci] += MAP_CONF[mr * MAP_COLS + mc];
+				count[ci]++;
 			}
 		}
+
+		frame->hist[ci] = frame->hist[ci] * PATCHES_PER_COLUMN / count[ci];
+		frame->col_conf[ci] = conf[ci] / count[ci];
+	}
+}
+
+
+void avoider(raw_state_t* state, float* throttle, float* steering)
+{
+	time_t now = time(NULL);
+	avoider_frame_t frame = {
+		.state = state,
+		.jobs = MIN(POOL.workers, HIST_W),
+	};
+	float* hist = frame.hist;
+	float confidence = 0;
+	float col_conf_best = 0;
+
+	if (MAP_STRIDE)
+	{
+		yuv422_region_f(state->view.luma, state->view.chroma, FRAME_W, 0, ROW_START, VIEW_W, MAP_H, MAP_RGB);
+
+		frame.jobs = MIN(POOL.workers, MAP_COLS * MAP_ROWS);
+		pool_run(&POOL, avoider_map, &frame, frame.jobs);
+		avoider_map_hist(&frame);
+	}
+	else
+	{
+		pool_run(&POOL, avoider_columns, &frame, frame.jobs);
+
+		if (FORWARD_STATE) avoider_paint_columns(state);
+	}
+
+	for (int ci = 0; ci < HIST_W; ++ci)
+	{
+		float col_conf_avg = frame.col_conf[ci];
+		if (col_conf_avg > col_conf_best) { col_conf_best = col_conf_avg; }
+
+		confidence += col_conf_avg;
 	}
 
+	confidence /= (float)HIST_W;
+
+	// *confidence /= (float)HIST_W;
+
+	// Here we pick the best, most contigious horizontal range of
+	// the frame with the smallest sum of 'bad' colors, or the
+	// largest sum of good colors if they are present. The score
+	// of a region also factors in the width so as the region grows
+	// without accumulating badness it becomes more attractive.
+	const float width_weight = 1;
+	int cont_r[2];
+	window_best(hist, HIST_W, width_weight, cont_r);
+
 	int target_idx = (cont_r[0] + cont_r[1]) >> 1;
 
 	// Decide which place in the region we should steer toward
@@ -188,13 +525,13 @@ void avoider(raw_state_t* state, float* throttle, float* steering)
 		int ci;
 
 		for (ci = cont_r[0] * BUCKET_SIZE; ci < cont_r[1] * BUCKET_SIZE; ci+=2)
-		for (int i = FRAME_H; i--;)
+		for (int i = VIEW_H; i--;)
 		{
 			state->view.luma[i * FRAME_W + ci] = 128;
 		}
 
-		ci = fp * FRAME_W;
-		for (int i = FRAME_H; i--;)
+		ci = MIN(fp * VIEW_W, VIEW_W - 1);
+		for (int i = VIEW_H; i--;)
 		{
 			state->view.luma[i * FRAME_W + ci] = 0;
 		}
@@ -235,7 +572,34 @@ void avoider(raw_state_t* state, float* throttle, float* steering)
 }
 
 time_t LAST_SECOND;
-raw_action_t predict(raw_state_t* state, waypoint_t* goal)
+// steering toward the route, 0 to 1 like the avoider's with 0.5 straight
+static float pursuit(raw_state_t* state, int goal)
+{
+	vec3 target, delta;
+	const float* h = state->heading;
+
+	// without dead reckoning the odometer says where on the route we are
+	float along = USE_DEADRECKONING ? route_progress(&ROUTE, goal, state->position) : state->distance;
+
+	route_point_at(&ROUTE, along + LOOKAHEAD_M, target);
+	vec3_sub(delta, target, state->position);
+
+	// the target in the car's frame, x forward and y to the left
+	float x = h[0] * delta[0] + h[1] * delta[1];
+	float y = h[0] * delta[1] - h[1] * delta[0];
+	float d2 = x * x + y * y;
+
+	if (d2 < 1e-4f) return 0.5f;
+
+	// the arc through the car and the target, tangent to the heading
+	float curvature = 2 * y / d2;
+	float angle = atanf(WHEELBASE_M * curvature);
+
+	return MAX(0, MIN(0.5f - angle / (2 * MAX_STEER_RAD), 1));
+}
+
+
+raw_action_t predict(raw_state_t* state, int goal)
 {
 	raw_action_t act = { 117, 117 };
 
@@ -243,79 +607,306 @@ raw_action_t predict(raw_state_t* state, waypoint_t* goal)
 	float steer = 0.5, throttle = 0.5;
 	avoider(state, &throttle, &steer);
 
+	// Follow the route while the avoider isn't backing up, trusting it
+	// less the less confident the avoider is about the way ahead
+	if (goal >= 0 && throttle >= 0.25f && vec3_len(state->heading) > 0.5f)
+	{
+		float w = (ROUTE_WEIGHT / 100.f) * MIN(throttle, 1);
+		steer = w * pursuit(state, goal) + (1 - w) * steer;
+
+		// Use a pid controller to regulate the throttle to match the speed driven
+		float target_vel = ROUTE.velocity[goal];
+		if (target_vel > 0)
+		{
+			float speed = PID_control(&SPEED_PID, target_vel, state->vel);
+			throttle = MIN(throttle, MAX(0.25f, speed));
+		}
+	}
+
 	// Lerp between right and left.
 	act.steering = 255 * steer; //CAL.steering.max * (1 - p) + CAL.steering.min * p;
 
-	// Use a pid controller to regulate the throttle to match the speed driven
 	act.throttle = 100 + throttle * 155;
 
 	return act;
 }
 
 
-void sig_handler(int sig)
+static void net_free(net_t* net)
 {
-	b_log("Caught signal %d", sig);
-	exit(0);
+	if (!net) return;
+
+	for (int i = 0; net->batches && i < POOL.workers; ++i)
+	{
+		batch_free(net->batches + i);
+	}
+
+	for (int i = 0; i < 2; ++i)
+	{
+		qdense_free(net->QL + i);
+	}
+
+	free(net->batches);
+	free(net->X.data.f);
+	model_release(&net->model);
+	free(net);
 }
 
 
-waypoint_t* best_waypoint(raw_state_t* state)
+static net_t* net_load(void)
 {
-	waypoint_t* next = NEXT_WPT;
-	waypoint_t* best = NEXT_WPT;
-	float dist_sum = 0;
+	net_t* net = (net_t*)calloc(1, sizeof(net_t));
+	if (!net) return NULL;
+
+	nn_layer_t* L = net->model.L;
+
+	if (model_load(&net->model, MODEL_DIR))
+	{
+		b_bad("Couldn't load the model from '%s'", MODEL_DIR);
+		goto fail;
+	}
 
-	while(next)
+	b_log("Loaded %d layer model from '%s' (%s)", net->model.layers, MODEL_DIR, net->model.map ? "mapped" : "tensor files");
+
+	net->X.dims[0] = 1;
+	net->X.dims[1] = L[0].w.dims[0];
+	if (nn_mat_init(&net->X)) goto fail;
+
+	for (int i = 0; i < net->model.layers; ++i)
+	{
+		if (nn_fc_init(L + i, i ? L[i - 1].A : &net->X)) goto fail;
+	}
+
+	// patches are gathered as raw pixel values, so whatever normalization
+	// the model still expects is folded into its first layer
+	if (net->model.input_scale != 1 || net->model.input_offset != 0)
 	{
-		vec3 delta;  // difference between car pos and waypoint pos
+		classifier_fold_input(L + 0, net->model.input_scale, net->model.input_offset);
+	}
 
-		if (USE_DEADRECKONING)
+	if (QUANTIZED)
+	{
+		const char* names[] = { "dense.q8", "dense_1.q8" };
+
+		if (net->model.layers != 2)
 		{
-			vec3 dir;    // unit vector direction to waypoint from car pos
-			float cost;
-			float co;    // coincidence with heading
-			float dist;
-			float lowest_cost = 1E10;
+			b_bad("The int8 model only supports two layers");
+			goto fail;
+		}
 
-			vec3_sub(delta, next->position, state->position);
-			vec3_norm(dir, delta);
-			co = vec3_mul_inner(dir, state->heading);
-			dist = vec3_len(delta);
+		for (int i = 0; i < 2; ++i)
+		{
+			char path[PATH_MAX];
+			snprintf(path, sizeof(path), "%s/%s", MODEL_DIR, names[i]);
 
-			cost = dist + (2 - (co + 1));
+			if (qdense_load(net->QL + i, path)) goto fail;
 
-			if (dist > 0.5)
-			{
-				if (cost < lowest_cost)
-				{
-					best = next;
-					lowest_cost = cost;
-				}
-			}
-			else if (next->next == NULL)
+			if (net->QL[i].in != L[i].w.dims[0] || net->QL[i].out != L[i].w.dims[1])
 			{
-				return NULL;
+				b_bad("'%s' doesn't match the float model, requantize it", path);
+				goto fail;
 			}
+		}
+
+		b_log("Using int8 model (%s)", qdot_impl()->name);
+	}
+
+	// enough for the largest frame, smaller ones can grow back to it
+	const int columns = (FRAME_W / BUCKET_SIZE + POOL.workers - 1) / POOL.workers;
+	const int capacity = MAP_STRIDE ?
+		(PATCHES_MAX + POOL.workers - 1) / POOL.workers :
+		columns * PATCHES_PER_COLUMN;
+	net->batches = (batch_t*)calloc(POOL.workers, sizeof(batch_t));
+	if (!net->batches) goto fail;
+
+	for (int i = 0; i < POOL.workers; ++i)
+	{
+		if (batch_init(net->batches + i, L, capacity)) goto fail;
+	}
+
+	return net;
+
+fail:
+	net_free(net);
+	return NULL;
+}
+
+
+static void sig_reload(int sig)
+{
+	char c = sig;
+	if (write(RELOAD_PIPE[1], &c, 1) < 0) { /* a reload is already pending */ }
+}
+
+
+static void drain(int fd)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	while (read(fd, buf, sizeof(buf)) > 0);
+}
+
+
+// reloads the model on SIGHUP or when anything in its directory changes,
+// the new one is picked up by inference before its next frame
+static void* model_watcher(void* params)
+{
+	int notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
 
+	if (notify_fd < 0 || inotify_add_watch(notify_fd, MODEL_DIR, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+	{
+		b_bad("Can't watch '%s', reload the model with SIGHUP", MODEL_DIR);
+	}
+
+	struct pollfd fds[] = {
+		{ .fd = RELOAD_PIPE[0], .events = POLLIN },
+		{ .fd = notify_fd, .events = POLLIN },
+	};
+	const int nfds = notify_fd < 0 ? 1 : 2;
+
+	while (1)
+	{
+		if (poll(fds, nfds, -1) <= 0) continue;
+
+		uint64_t noticed_us = mono_us();
+
+		// the trainer writes several files, wait until they all landed
+		do
+		{
+			for (int i = nfds; i--;) drain(fds[i].fd);
 		}
-		else
+		while (poll(fds, nfds, MODEL_SETTLE_MS) > 0);
+
+		uint64_t start_us = mono_us();
+		net_t* net = net_load();
+
+		if (!net)
 		{
-			if (!next->next) return NULL;
+			b_bad("Keeping the current model");
+			continue;
+		}
+
+		net->noticed_us = noticed_us;
+		b_log("New model loaded in %0.2f ms", (mono_us() - start_us) / 1000.0);
+
+		// one that was never picked up has no users
+		net_free(__atomic_exchange_n(&NEXT_NET, net, __ATOMIC_ACQ_REL));
+	}
+
+	return NULL;
+}
+
+
+static void net_swap(net_t* next)
+{
+	// the pool is idle between frames, nothing else holds the old one
+	net_t* old = NET;
+	NET = next;
+	net_free(old);
+
+	// cached classes came from the old model
+	for (int i = MAP_STRIDE ? MAP_COLS * MAP_ROWS : HIST_W * PATCHES_PER_COLUMN; i--;)
+	{
+		CACHE[i].valid = 0;
+	}
+
+	b_good("Model swapped in, live %0.2f ms after the change", (mono_us() - next->noticed_us) / 1000.0);
+}
+
+
+static void log_stats(void)
+{
+	pipeline_log_stats();
+	spsc_log_stats(&IN_Q, "in");
+	spsc_log_stats(&OUT_Q, "out");
+
+	if (LATEST_ONLY)
+	{
+		b_log("%" PRIu64 " queued frames skipped", SKIPPED);
+	}
+
+	if (REUSE_MAD)
+	{
+		b_log("%" PRIu64 " patches classified, %" PRIu64 " reused (%0.1f%%)",
+			CLASSIFIED,
+			REUSED,
+			CLASSIFIED + REUSED ? 100.0 * REUSED / (CLASSIFIED + REUSED) : 0
+		);
+	}
+}
+
+
+void sig_handler(int sig)
+{
+	b_log("Caught signal %d", sig);
+	log_stats();
+	exit(0);
+}
 
-			vec3_sub(delta, next->position, next->next->position);
-			dist_sum += vec3_len(delta);
 
-			if (dist_sum > state->distance)
+static void* reader_stage(void* params)
+{
+	while (1)
+	{
+		message_t* msg;
+
+		// prefer buffers inference skipped, they would sit idle otherwise
+		if (spsc_try_pop(&RECYCLE_Q, &msg))
+		{
+			msg = spsc_pop(&FREE_Q);
+		}
+
+		int res = read_pipeline_payload(msg, PAYLOAD_STATE);
+
+		if (res)
+		{
+			if (res == PIPE_EOF)
 			{
-				return next;
+				b_log("Upstream closed");
 			}
+			else
+			{
+				b_bad("read error (%d)", res);
+				READ_RES = res;
+			}
+
+			spsc_push(&IN_Q, NULL);
+			return NULL;
 		}
 
-		next = next->next; // lol
+		spsc_push(&IN_Q, msg);
 	}
+}
+
+
+static void* writer_stage(void* params)
+{
+	message_t* msg;
 
-	return best;
+	while ((msg = spsc_pop(&OUT_Q)))
+	{
+		if (write_pipeline_payload(msg))
+		{
+			b_bad("Failed to write payload");
+			exit(-1);
+		}
+
+		spsc_push(&FREE_Q, msg);
+	}
+
+	return NULL;
+}
+
+
+int best_waypoint(raw_state_t* state)
+{
+	if (NEXT_WPT < 0) return -1;
+
+	if (USE_DEADRECKONING)
+	{
+		return route_best(&ROUTE, NEXT_WPT, state->position, state->heading);
+	}
+
+	return route_at_distance(&ROUTE, state->distance);
 }
 
 
@@ -325,26 +916,6 @@ int main(int argc, char* const argv[])
 
 	signal(SIGINT, sig_handler);
 
-	mat_t x = {
-		.dims = { 1, 768 },
-	};
-	X = x;
-
-	nn_layer_t l[] = {
-		{
-			.w = nn_mat_load(ROOT_MODEL_DIR "dense.kernel"),
-			.b = nn_mat_load(ROOT_MODEL_DIR "dense.bias"),
-			.activation = nn_act_relu
-		},
-		{
-			.w = nn_mat_load(ROOT_MODEL_DIR "dense_1.kernel"),
-			.b = nn_mat_load(ROOT_MODEL_DIR "dense_1.bias"),
-			.activation = nn_act_softmax
-		},
-		{}
-	};
-	L = l;
-
 	// Define and process command line, args
 	cli_cmd_t cmds[] = {
 		{ 'f',
@@ -353,72 +924,205 @@ int main(int argc, char* const argv[])
 		},
 		{ 'r',
 			.desc = "Path for route file to load",
+			.usage = "-r [route_file]",
+			.opts = { .has_value = 1 },
 			.set = arg_load_route,
 			.type = ARG_TYP_CALLBACK
 		},
+		{ 'w',
+			.desc = "Percent of the steering taken from following the route, defaults to 50",
+			.usage = "-w [percent]",
+			.opts = { .has_value = 1 },
+			.set = &ROUTE_WEIGHT,
+			.type = ARG_TYP_INT,
+		},
 		{ 'd',
 			.desc = "Enable deadreckoning",
 			.set = &USE_DEADRECKONING,
 		},
+		{ 'l',
+			.desc = "Only process the latest frame, dropping any that queued up",
+			.set = &LATEST_ONLY,
+		},
+		{ 'q',
+			.desc = "Classify with the int8 model made by ml/quantize.py",
+			.set = &QUANTIZED,
+		},
+		{ 'M',
+			.desc = "Directory holding the model, " MODEL_FILE " or the tensor files trainer.py exports",
+			.usage = "-M [model_dir]",
+			.opts = { .has_value = 1 },
+			.set = &MODEL_DIR,
+			.type = ARG_TYP_STR,
+		},
+		{ 'b',
+			.desc = "Width in pixels of the columns the frame is split into to steer by, defaults to 32",
+			.usage = "-b [pixels]",
+			.opts = { .has_value = 1 },
+			.set = &BUCKET_SIZE,
+			.type = ARG_TYP_INT,
+		},
+		{ 'g',
+			.desc = "Classify a dense map of patches every [stride] pixels across the region instead of sampling each column",
+			.usage = "-g [stride]",
+			.opts = { .has_value = 1 },
+			.set = &MAP_STRIDE,
+			.type = ARG_TYP_INT,
+		},
+		{ 't',
+			.desc = "Reuse a patch's classes until its luma differs by more than [mad] per pixel on average from when it was classified",
+			.usage = "-t [mad]",
+			.opts = { .has_value = 1 },
+			.set = &REUSE_MAD,
+			.type = ARG_TYP_INT,
+		},
+		{ 'a',
+			.desc = "Frames a patch's classes can be reused for before it's classified again, defaults to 15",
+			.usage = "-a [frames]",
+			.opts = { .has_value = 1 },
+			.set = &REUSE_MAX_AGE,
+			.type = ARG_TYP_INT,
+		},
+		{ 'j',
+			.desc = "Threads used to classify the frame, defaults to one per core except the pose estimator's",
+			.usage = "-j [threads]",
+			.opts = { .has_value = 1 },
+			.set = &THREADS,
+			.type = ARG_TYP_INT,
+		},
 		{}
 	};
 	cli("Collects data from sensors, compiles them into system\n"
 	    "state packets. Then forwards them over stdout", cmds, argc, argv);
 
-	assert(nn_mat_init(&X) == 0);
-	assert(nn_fc_init(L + 0, &X) == 0);
-	assert(nn_fc_init(L + 1, L[0].A) == 0);
+	pipeline_set_latest(LATEST_ONLY);
+
+	if (BUCKET_SIZE < 2 || BUCKET_SIZE > FRAME_W)
+	{
+		b_bad("The column width must be 2 to %d pixels", FRAME_W);
+		exit(-1);
+	}
+
+	if (MAP_STRIDE < 0 || MAP_STRIDE > PATCH_SIZE || (MAP_STRIDE && QUANTIZED))
+	{
+		b_bad("The map stride must be 1 to %d, and the map is only classified in float", PATCH_SIZE);
+		exit(-1);
+	}
+
+	if (ROUTE_WEIGHT < 0 || ROUTE_WEIGHT > 100)
+	{
+		b_bad("The route weight is a percentage");
+		exit(-1);
+	}
+
+	avoider_init();
+
+	NET = net_load();
+	if (!NET) exit(-1);
+
+	assert(pipe(RELOAD_PIPE) == 0);
+	fcntl(RELOAD_PIPE[0], F_SETFL, O_NONBLOCK);
+	fcntl(RELOAD_PIPE[1], F_SETFL, O_NONBLOCK);
+	signal(SIGHUP, sig_reload);
+
+	pthread_t watcher;
+	assert(pthread_create(&watcher, NULL, model_watcher, NULL) == 0);
+	pthread_detach(watcher);
 
 	b_log("Waiting...");
 
-	while(1)
+	assert(spsc_init(&FREE_Q, QUEUE_SIZE) == 0);
+	assert(spsc_init(&IN_Q, QUEUE_SIZE) == 0);
+	assert(spsc_init(&OUT_Q, QUEUE_SIZE) == 0);
+	assert(spsc_init(&RECYCLE_Q, QUEUE_SIZE) == 0);
+
+	for (int i = MSG_BUFFERS; i--;)
 	{
-		message_t msg = {};
+		message_t* msg = message_alloc(PAYLOAD_STATE, FIELD_ALL);
+		assert(msg);
+		spsc_push(&FREE_Q, msg);
+	}
 
-		if (!read_pipeline_payload(&msg, PAYLOAD_STATE))
-		{
-			raw_state_t* state = &msg.payload.state;
-			raw_action_t act = predict(state, NEXT_WPT);
+	// reading and writing overlap with inference of the frame between them
+	pthread_t reader, writer;
+	assert(pthread_create(&reader, NULL, reader_stage, NULL) == 0);
+	assert(pthread_create(&writer, NULL, writer_stage, NULL) == 0);
+
+	message_t* msg;
+	int upstream_open = 1;
 
-			msg.header.type = PAYLOAD_ACTION;
-			msg.payload.pair.action = act;
+	while(upstream_open && (msg = spsc_pop(&IN_Q)))
+	{
+		message_t* newer;
 
-			if (USE_DEADRECKONING)
+		// frames that queued up while the last was classified are stale
+		while (LATEST_ONLY && !spsc_try_pop(&IN_Q, &newer))
+		{
+			if (!newer)
 			{
-				b_log("Reckoning...");
-				waypoint_t* next = best_waypoint(state);
-				if (next != NEXT_WPT)
-				{
-					NEXT_WPT = next;
-					b_log("next waypoint: %lx", (unsigned int)NEXT_WPT);
-				}
-
-				if (NEXT_WPT == NULL)
-				{
-					b_bad("No waypoints loaded");
-					exit(-2);
-				}
+				upstream_open = 0;
+				break;
 			}
 
-			if (FORWARD_STATE)
+			spsc_push(&RECYCLE_Q, msg);
+			msg = newer;
+			SKIPPED++;
+		}
+
+		// a reloaded model takes over between frames
+		net_t* next = __atomic_exchange_n(&NEXT_NET, NULL, __ATOMIC_ACQ_REL);
+		if (next) net_swap(next);
+
+		// the collector may capture smaller frames than the view holds
+		if (msg->header.width != VIEW_W || msg->header.height != VIEW_H)
+		{
+			if (avoider_resize(msg->header.width, msg->header.height)) exit(-3);
+			b_log("Classifying %dx%d frames", VIEW_W, VIEW_H);
+		}
+
+		raw_state_t* state = &msg->payload.state;
+		raw_action_t act = predict(state, NEXT_WPT);
+
+		message_set_type(msg, PAYLOAD_ACTION);
+		msg->payload.action = act;
+
+		// without dead reckoning the route is followed by distance driven
+		// until it runs out
+		if (USE_DEADRECKONING || NEXT_WPT >= 0)
+		{
+			int next = best_waypoint(state);
+			if (next != NEXT_WPT)
 			{
-				msg.header.type = PAYLOAD_PAIR;
+				NEXT_WPT = next;
+				b_log("next waypoint: %d", NEXT_WPT);
 			}
 
-			if (write_pipeline_payload(&msg))
+			if (USE_DEADRECKONING && NEXT_WPT < 0)
 			{
-				b_bad("Failed to write payload");
-				return -1;
+				b_bad("No waypoints loaded");
+				exit(-2);
 			}
 		}
-		else
-		{
-			b_bad("read error");
 
-			return -1;
+		if (FORWARD_STATE)
+		{
+			message_set_type(msg, PAYLOAD_PAIR);
 		}
+
+		spsc_push(&OUT_Q, msg);
+	}
+
+	// let the writer flush what's left
+	spsc_push(&OUT_Q, NULL);
+	pthread_join(writer, NULL);
+	pthread_join(reader, NULL);
+
+	if (READ_RES)
+	{
+		return -1;
 	}
 
+	log_stats();
 	b_bad("terminating");
 
 	return 0;
@@ -0,0 +1,283 @@
+#include <errno.h>
+
+#include "sys.h"
+#include "qdense.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QDENSE_X86
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define QDENSE_NEON
+#endif
+
+// output channels per tile, the tile's weights stay in L1 while every row
+// of the batch is multiplied against them
+#define TILE_BYTES (16 * 1024)
+
+
+static int32_t qdot_scalar(const int8_t* a, const int8_t* b, int n)
+{
+	int32_t sum = 0;
+
+	for (int i = 0; i < n; ++i)
+	{
+		sum += a[i] * b[i];
+	}
+
+	return sum;
+}
+
+
+#ifdef QDENSE_X86
+
+static int cpu_has_sse2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+
+static int cpu_has_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+
+__attribute__((target("sse2")))
+static int32_t qdot_sse2(const int8_t* a, const int8_t* b, int n)
+{
+	__m128i acc = _mm_setzero_si128();
+	int i = 0;
+
+	for (; i + 16 <= n; i += 16)
+	{
+		const __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+		const __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+
+		// sign extend to 16 bits by unpacking into the high byte and shifting down
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(
+			_mm_srai_epi16(_mm_unpacklo_epi8(va, va), 8),
+			_mm_srai_epi16(_mm_unpacklo_epi8(vb, vb), 8)));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(
+			_mm_srai_epi16(_mm_unpackhi_epi8(va, va), 8),
+			_mm_srai_epi16(_mm_unpackhi_epi8(vb, vb), 8)));
+	}
+
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+
+	return _mm_cvtsi128_si32(acc) + qdot_scalar(a + i, b + i, n - i);
+}
+
+
+__attribute__((target("avx2")))
+static int32_t qdot_avx2(const int8_t* a, const int8_t* b, int n)
+{
+	__m256i acc = _mm256_setzero_si256();
+	int i = 0;
+
+	for (; i + 16 <= n; i += 16)
+	{
+		const __m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a + i)));
+		const __m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i)));
+
+		acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+	}
+
+	__m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+
+	return _mm_cvtsi128_si32(sum) + qdot_scalar(a + i, b + i, n - i);
+}
+
+#endif
+
+
+#ifdef QDENSE_NEON
+
+static int32_t qdot_neon(const int8_t* a, const int8_t* b, int n)
+{
+	int32x4_t acc = vdupq_n_s32(0);
+	int i = 0;
+
+	for (; i + 16 <= n; i += 16)
+	{
+		const int8x16_t va = vld1q_s8(a + i);
+		const int8x16_t vb = vld1q_s8(b + i);
+
+#ifdef __ARM_FEATURE_DOTPROD
+		acc = vdotq_s32(acc, va, vb);
+#else
+		// int8 products always fit in 16 bits, pairs are widened as they're added
+		acc = vpadalq_s16(acc, vmull_s8(vget_low_s8(va), vget_low_s8(vb)));
+		acc = vpadalq_s16(acc, vmull_s8(vget_high_s8(va), vget_high_s8(vb)));
+#endif
+	}
+
+	int32x2_t sum = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+	return vget_lane_s32(vpadd_s32(sum, sum), 0) + qdot_scalar(a + i, b + i, n - i);
+}
+
+#endif
+
+
+const qdot_impl_t QDOT_IMPLS[] = {
+#ifdef QDENSE_X86
+	{ "avx2", qdot_avx2, cpu_has_avx2 },
+	{ "sse2", qdot_sse2, cpu_has_sse2 },
+#endif
+#ifdef QDENSE_NEON
+	{ "neon", qdot_neon, NULL },
+#endif
+	{ "scalar", qdot_scalar, NULL },
+	{}
+};
+
+
+const qdot_impl_t* qdot_impl(void)
+{
+	static const qdot_impl_t* best;
+	const qdot_impl_t* impl = __atomic_load_n(&best, __ATOMIC_ACQUIRE);
+
+	if (impl) return impl;
+
+	for (impl = QDOT_IMPLS; impl->supported && !impl->supported(); ++impl);
+	__atomic_store_n(&best, impl, __ATOMIC_RELEASE);
+
+	return impl;
+}
+
+
+static int read_all(int fd, void* dst, size_t len)
+{
+	for (size_t off = 0; off < len;)
+	{
+		ssize_t n = read(fd, (uint8_t*)dst + off, len - off);
+
+		if (n <= 0)
+		{
+			if (n < 0 && errno == EINTR) continue;
+			return -1;
+		}
+
+		off += n;
+	}
+
+	return 0;
+}
+
+
+int qdense_load(qdense_t* layer, const char* path)
+{
+	qdense_hdr_t hdr;
+	int fd = open(path, O_RDONLY);
+	int res = -1;
+
+	memset(layer, 0, sizeof(qdense_t));
+
+	if (fd < 0)
+	{
+		b_bad("Couldn't open quantized layer '%s'", path);
+		return -1;
+	}
+
+	if (read_all(fd, &hdr, sizeof(hdr)) || hdr.magic != QDENSE_MAGIC || hdr.version != QDENSE_VERSION)
+	{
+		b_bad("'%s' is not a quantized layer (version %d)", path, QDENSE_VERSION);
+		goto done;
+	}
+
+	layer->in = hdr.in;
+	layer->out = hdr.out;
+	layer->scale = (float*)calloc(hdr.out, sizeof(float));
+	layer->bias = (float*)calloc(hdr.out, sizeof(float));
+	layer->sum = (int32_t*)calloc(hdr.out, sizeof(int32_t));
+	layer->w = (int8_t*)calloc(hdr.out * hdr.in, sizeof(int8_t));
+
+	if (!layer->scale || !layer->bias || !layer->sum || !layer->w) goto done;
+
+	if (read_all(fd, layer->scale, hdr.out * sizeof(float)) ||
+	    read_all(fd, layer->bias, hdr.out * sizeof(float)) ||
+	    read_all(fd, layer->w, hdr.out * hdr.in))
+	{
+		b_bad("'%s' is truncated", path);
+		goto done;
+	}
+
+	for (int j = layer->out; j--;)
+	for (int i = layer->in; i--;)
+	{
+		layer->sum[j] += layer->w[j * layer->in + i];
+	}
+
+	res = 0;
+
+done:
+	close(fd);
+	return res;
+}
+
+
+void qdense_free(qdense_t* layer)
+{
+	free(layer->scale);
+	free(layer->bias);
+	free(layer->sum);
+	free(layer->w);
+	memset(layer, 0, sizeof(qdense_t));
+}
+
+
+void qdense_forward(const qdense_t* layer, const int8_t* q, const float* x_scale, float offset, int rows, float* y)
+{
+	const qdot_fn dot = qdot_impl()->dot;
+	const int in = layer->in, out = layer->out;
+	const int tile = TILE_BYTES / in > 0 ? TILE_BYTES / in : 1;
+
+	for (int j0 = 0; j0 < out; j0 += tile)
+	{
+		const int j1 = j0 + tile < out ? j0 + tile : out;
+
+		for (int r = 0; r < rows; ++r)
+		{
+			const int8_t* q_r = q + r * in;
+
+			for (int j = j0; j < j1; ++j)
+			{
+				int32_t acc = dot(q_r, layer->w + j * in, in);
+				y[r * out + j] = x_scale[r] * layer->scale[j] * (acc + offset * layer->sum[j]) + layer->bias[j];
+			}
+		}
+	}
+}
+
+
+void qdense_quantize_rows(const float* x, int rows, int cols, int8_t* q, float* scale)
+{
+	for (int r = 0; r < rows; ++r)
+	{
+		const float* x_r = x + r * cols;
+		float max = 0;
+
+		for (int i = 0; i < cols; ++i)
+		{
+			max = fabsf(x_r[i]) > max ? fabsf(x_r[i]) : max;
+		}
+
+		scale[r] = max > 0 ? max / 127.f : 1.f;
+		const float inv = 1.f / scale[r];
+
+		for (int i = 0; i < cols; ++i)
+		{
+			// round half away from zero, same as ml/quantize.py
+			float v = x_r[i] * inv;
+			int c = (int)(v + (v < 0 ? -0.5f : 0.5f));
+			q[r * cols + i] = c > 127 ? 127 : (c < -127 ? -127 : c);
+		}
+	}
+}
@@ -0,0 +1,81 @@
+#ifndef AVC_QDENSE
+#define AVC_QDENSE
+
+#include <inttypes.h>
+
+#define QDENSE_MAGIC   0x38515641 // 'AVQ8'
+#define QDENSE_VERSION 1
+
+/**
+ * @brief Header of a quantized dense layer file, as written by
+ *        ml/quantize.py. It is followed by float scale[out], float bias[out]
+ *        and int8 weights[out][in].
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t in, out;
+} qdense_hdr_t;
+
+/**
+ * @brief Dense layer with int8 weights and one scale per output channel,
+ *        weight[i][j] ~= w[j * in + i] * scale[j]. Each channel's weights are
+ *        contiguous so outputs are dot products of two int8 vectors.
+ */
+typedef struct {
+	int in, out;
+	float* scale;  // [out]
+	float* bias;   // [out]
+	int32_t* sum;  // [out] sum of each channel's weights
+	int8_t* w;     // [out x in]
+} qdense_t;
+
+typedef int32_t (*qdot_fn)(const int8_t* a, const int8_t* b, int n);
+
+typedef struct {
+	const char* name;
+	qdot_fn dot;
+	int (*supported)(void); // NULL if always available
+} qdot_impl_t;
+
+/**
+ * @brief Every dot product built for this target, fastest first and
+ *        terminated by an empty entry. All of them return the same sums.
+ */
+extern const qdot_impl_t QDOT_IMPLS[];
+
+/**
+ * @brief Returns the fastest dot product the running cpu supports.
+ */
+const qdot_impl_t* qdot_impl(void);
+
+/**
+ * @brief Loads a layer written by ml/quantize.py.
+ * @return 0 on success
+ */
+int qdense_load(qdense_t* layer, const char* path);
+
+/**
+ * @brief Releases a layer loaded with qdense_load().
+ */
+void qdense_free(qdense_t* layer);
+
+/**
+ * @brief Computes y = x * weights + bias for every row. Inputs are int8
+ *        codes where x[r][i] = (q[r][i] + offset) * x_scale[r], products
+ *        are accumulated in int32.
+ * @param layer - layer to apply
+ * @param q - [rows x in] input codes
+ * @param x_scale - [rows] scale of each input row
+ * @param offset - constant added to every code
+ * @param rows - number of rows
+ * @param y - [rows x out] output
+ */
+void qdense_forward(const qdense_t* layer, const int8_t* q, const float* x_scale, float offset, int rows, float* y);
+
+/**
+ * @brief Quantizes each row of x symmetrically to int8 with its own scale.
+ */
+void qdense_quantize_rows(const float* x, int rows, int cols, int8_t* q, float* scale);
+
+#endif
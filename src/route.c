@@ -0,0 +1,513 @@
+#include <errno.h>
+
+#include "sys.h"
+#include "route.h"
+
+// waypoints per grid cell the grid is sized for
+#define ROUTE_PER_CELL 4
+
+
+static int cell_x(const route_t* route, float x)
+{
+	int c = floorf((x - route->grid.min_x) / route->grid.cell);
+	return MAX(0, MIN(c, route->grid.w - 1));
+}
+
+
+static int cell_y(const route_t* route, float y)
+{
+	int c = floorf((y - route->grid.min_y) / route->grid.cell);
+	return MAX(0, MIN(c, route->grid.h - 1));
+}
+
+
+static int grid_init(route_t* route)
+{
+	float min_x = route->x[0], max_x = route->x[0];
+	float min_y = route->y[0], max_y = route->y[0];
+
+	for (int i = route->count; i--;)
+	{
+		min_x = MIN(min_x, route->x[i]);
+		max_x = MAX(max_x, route->x[i]);
+		min_y = MIN(min_y, route->y[i]);
+		max_y = MAX(max_y, route->y[i]);
+	}
+
+	// about ROUTE_PER_CELL waypoints a cell if they're spread out, without
+	// letting a straight route turn into a huge row of cells
+	const float w = max_x - min_x, h = max_y - min_y;
+	float cell = sqrtf(w * h * ROUTE_PER_CELL / route->count);
+	cell = MAX(cell, MAX(w, h) * ROUTE_PER_CELL / route->count);
+	if (cell <= 0) cell = 1;
+
+	route->grid.min_x = min_x;
+	route->grid.min_y = min_y;
+	route->grid.cell = cell;
+	route->grid.w = w / cell + 1;
+	route->grid.h = h / cell + 1;
+
+	const int cells = route->grid.w * route->grid.h;
+	route->grid.start = (int*)calloc(cells + 1, sizeof(int));
+	route->grid.index = (int*)calloc(route->count, sizeof(int));
+	int* fill = (int*)calloc(cells, sizeof(int));
+
+	if (!route->grid.start || !route->grid.index || !fill)
+	{
+		free(fill);
+		return -1;
+	}
+
+	for (int i = 0; i < route->count; ++i)
+	{
+		route->grid.start[cell_y(route, route->y[i]) * route->grid.w + cell_x(route, route->x[i]) + 1]++;
+	}
+
+	for (int c = 0; c < cells; ++c)
+	{
+		route->grid.start[c + 1] += route->grid.start[c];
+	}
+
+	// ascending order keeps each cell's waypoints in route order
+	for (int i = 0; i < route->count; ++i)
+	{
+		int c = cell_y(route, route->y[i]) * route->grid.w + cell_x(route, route->x[i]);
+		route->grid.index[route->grid.start[c] + fill[c]++] = i;
+	}
+
+	free(fill);
+	return 0;
+}
+
+
+// the route's arrays in file order
+static void route_arrays(route_t* route, float** arrays[ROUTE_ARRAYS])
+{
+	arrays[0] = &route->x;
+	arrays[1] = &route->y;
+	arrays[2] = &route->z;
+	arrays[3] = &route->hx;
+	arrays[4] = &route->hy;
+	arrays[5] = &route->hz;
+	arrays[6] = &route->velocity;
+	arrays[7] = &route->distance;
+}
+
+
+static uint64_t align_up(uint64_t bytes)
+{
+	return (bytes + ROUTE_ALIGN - 1) / ROUTE_ALIGN * ROUTE_ALIGN;
+}
+
+
+int route_init(route_t* route, const waypoint_t* waypoints, int count)
+{
+	float** arrays[ROUTE_ARRAYS];
+
+	memset(route, 0, sizeof(route_t));
+
+	if (count <= 0) return -1;
+
+	float* mem = (float*)calloc(count * ROUTE_ARRAYS, sizeof(float));
+	if (!mem) return -2;
+
+	route_arrays(route, arrays);
+	for (int i = 0; i < ROUTE_ARRAYS; ++i)
+	{
+		*arrays[i] = mem + i * count;
+	}
+
+	for (int i = 0; i < count; ++i)
+	{
+		route->x[i] = waypoints[i].position[0];
+		route->y[i] = waypoints[i].position[1];
+		route->z[i] = waypoints[i].position[2];
+		route->hx[i] = waypoints[i].heading[0];
+		route->hy[i] = waypoints[i].heading[1];
+		route->hz[i] = waypoints[i].heading[2];
+		route->velocity[i] = waypoints[i].velocity;
+	}
+
+	// summed in double so long routes don't drift
+	double walked = 0;
+	for (int i = 1; i < count; ++i)
+	{
+		vec3 delta;
+
+		vec3_sub(delta, waypoints[i].position, waypoints[i - 1].position);
+		walked += vec3_len(delta);
+		route->distance[i] = walked;
+	}
+
+	route->count = count;
+
+	return grid_init(route) ? -3 : 0;
+}
+
+
+int route_map(route_t* route, const char* path)
+{
+	struct stat st;
+	float** arrays[ROUTE_ARRAYS];
+	int fd = open(path, O_RDONLY);
+
+	memset(route, 0, sizeof(route_t));
+
+	if (fd < 0) return -1;
+
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(route_hdr_t))
+	{
+		b_bad("'%s' is not a route", path);
+		close(fd);
+		return -2;
+	}
+
+	void* mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (mem == MAP_FAILED)
+	{
+		b_bad("Couldn't map '%s' (%d)", path, errno);
+		return -3;
+	}
+
+	route->map = mem;
+	route->size = st.st_size;
+
+	const route_hdr_t* hdr = (const route_hdr_t*)mem;
+
+	if (hdr->magic != ROUTE_MAGIC || hdr->version != ROUTE_VERSION)
+	{
+		b_bad("'%s' is not a route (version %d)", path, ROUTE_VERSION);
+		goto fail;
+	}
+
+	if (hdr->size != route->size || !hdr->count || hdr->count > INT_MAX / ROUTE_ARRAYS)
+	{
+		b_bad("'%s' is truncated or has %u waypoints", path, hdr->count);
+		goto fail;
+	}
+
+	route->count = hdr->count;
+	route_arrays(route, arrays);
+
+	for (int i = 0; i < ROUTE_ARRAYS; ++i)
+	{
+		if (hdr->off[i] % ROUTE_ALIGN || hdr->off[i] > route->size ||
+		    hdr->off[i] + route->count * sizeof(float) > route->size)
+		{
+			b_bad("'%s' array %d is malformed", path, i);
+			goto fail;
+		}
+
+		*arrays[i] = (float*)((uint8_t*)mem + hdr->off[i]);
+	}
+
+	// route_at_distance() relies on this to search
+	for (int i = 1; i < route->count; ++i)
+	{
+		if (!(route->distance[i] >= route->distance[i - 1]))
+		{
+			b_bad("'%s' distance decreases at waypoint %d", path, i);
+			goto fail;
+		}
+	}
+
+	if (grid_init(route)) goto fail;
+
+	return 0;
+
+fail:
+	route_release(route);
+	return -4;
+}
+
+
+static int route_load_legacy(route_t* route, const char* path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		b_bad("Loading route: '%s' failed", path);
+		return -1;
+	}
+
+	off_t all_bytes = lseek(fd, 0, SEEK_END);
+	size_t count = all_bytes / sizeof(waypoint_t);
+	lseek(fd, 0, SEEK_SET);
+
+	waypoint_t* waypoints = (waypoint_t*)calloc(count + 1, sizeof(waypoint_t));
+	size_t read_bytes = waypoints ? read(fd, waypoints, count * sizeof(waypoint_t)) : 0;
+	close(fd);
+
+	if (!count || read_bytes != count * sizeof(waypoint_t))
+	{
+		b_bad("route read of %zu/%ldB failed", read_bytes, (long)all_bytes);
+		free(waypoints);
+		return -2;
+	}
+
+	int res = route_init(route, waypoints, count);
+	free(waypoints);
+
+	return res;
+}
+
+
+int route_load(route_t* route, const char* path)
+{
+	uint32_t magic = 0;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		b_bad("Loading route: '%s' failed", path);
+		return -1;
+	}
+
+	// a legacy route starts with the x of its first waypoint, which would
+	// have to be ~3.6e12 to look like the magic
+	int is_mapped = read(fd, &magic, sizeof(magic)) == sizeof(magic) && magic == ROUTE_MAGIC;
+	close(fd);
+
+	int res = is_mapped ? route_map(route, path) : route_load_legacy(route, path);
+
+	if (!res)
+	{
+		b_log("Loaded %sroute with %d waypoints, %0.1fm long",
+		      is_mapped ? "" : "legacy ", route->count, route->distance[route->count - 1]);
+	}
+
+	return res;
+}
+
+
+int route_save(const route_t* route, const char* path)
+{
+	char tmp_path[PATH_MAX];
+	float** arrays[ROUTE_ARRAYS];
+	route_hdr_t hdr = {
+		.magic = ROUTE_MAGIC,
+		.version = ROUTE_VERSION,
+		.count = route->count,
+	};
+	const uint64_t array_bytes = route->count * sizeof(float);
+
+	route_arrays((route_t*)route, arrays);
+
+	hdr.off[0] = align_up(sizeof(hdr));
+	for (int i = 1; i < ROUTE_ARRAYS; ++i)
+	{
+		hdr.off[i] = hdr.off[i - 1] + align_up(array_bytes);
+	}
+	hdr.size = hdr.off[ROUTE_ARRAYS - 1] + array_bytes;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+	{
+		b_bad("Couldn't create '%s'", tmp_path);
+		return -1;
+	}
+
+	int res = write(fd, &hdr, sizeof(hdr)) != sizeof(hdr);
+
+	for (int i = 0; i < ROUTE_ARRAYS && !res; ++i)
+	{
+		res |= lseek(fd, hdr.off[i], SEEK_SET) < 0;
+		res |= write(fd, *arrays[i], array_bytes) != (ssize_t)array_bytes;
+	}
+
+	res |= close(fd);
+
+	if (res || rename(tmp_path, path))
+	{
+		b_bad("Writing route '%s' failed", path);
+		unlink(tmp_path);
+		return -2;
+	}
+
+	return 0;
+}
+
+
+void route_release(route_t* route)
+{
+	if (route->map)
+	{
+		munmap(route->map, route->size);
+	}
+	else
+	{
+		free(route->x);
+	}
+
+	free(route->grid.start);
+	free(route->grid.index);
+	memset(route, 0, sizeof(route_t));
+}
+
+
+static float distance_to(const route_t* route, int i, const vec3 position)
+{
+	vec3 delta = {
+		route->x[i] - position[0],
+		route->y[i] - position[1],
+		route->z[i] - position[2],
+	};
+
+	return vec3_len(delta);
+}
+
+
+// cost of steering for waypoint i, or INFINITY if it's already reached
+static float cost_of(const route_t* route, int i, const vec3 position, const vec3 heading)
+{
+	vec3 delta = {
+		route->x[i] - position[0],
+		route->y[i] - position[1],
+		route->z[i] - position[2],
+	};
+	vec3 dir;
+
+	float dist = vec3_len(delta);
+	if (dist <= ROUTE_REACHED) return INFINITY;
+
+	vec3_norm(dir, delta);
+	float co = vec3_mul_inner(dir, heading); // coincidence with heading
+
+	return dist + (2 - (co + 1));
+}
+
+
+int route_best(const route_t* route, int from, const vec3 position, const vec3 heading)
+{
+	const int last = route->count - 1;
+
+	if (from < 0 || from > last) return -1;
+	if (distance_to(route, last, position) <= ROUTE_REACHED) return -1;
+
+	int best = from;
+	float best_cost = INFINITY;
+	const int window_end = MIN(from + ROUTE_WINDOW, route->count);
+
+	// the waypoints just ahead usually hold the best one, which bounds
+	// how far away a better one could be
+	for (int i = from; i < window_end; ++i)
+	{
+		float cost = cost_of(route, i, position, heading);
+		if (cost < best_cost)
+		{
+			best = i;
+			best_cost = cost;
+		}
+	}
+
+	if (window_end == route->count) return best;
+
+	if (isinf(best_cost))
+	{
+		// nothing to bound the search with
+		for (int i = window_end; i < route->count; ++i)
+		{
+			float cost = cost_of(route, i, position, heading);
+			if (cost < best_cost)
+			{
+				best = i;
+				best_cost = cost;
+			}
+		}
+
+		return best;
+	}
+
+	// cost is never below distance, so only cells within best_cost of the
+	// position can hold a better waypoint
+	const int x0 = cell_x(route, position[0] - best_cost), x1 = cell_x(route, position[0] + best_cost);
+	const int y0 = cell_y(route, position[1] - best_cost), y1 = cell_y(route, position[1] + best_cost);
+
+	for (int cy = y0; cy <= y1; ++cy)
+	for (int cx = x0; cx <= x1; ++cx)
+	{
+		const int c = cy * route->grid.w + cx;
+
+		for (int k = route->grid.start[c]; k < route->grid.start[c + 1]; ++k)
+		{
+			const int i = route->grid.index[k];
+			if (i < window_end) continue;
+
+			float cost = cost_of(route, i, position, heading);
+			if (cost < best_cost || (cost == best_cost && i < best))
+			{
+				best = i;
+				best_cost = cost;
+			}
+		}
+	}
+
+	return best;
+}
+
+
+int route_at_distance(const route_t* route, float distance)
+{
+	// first waypoint beyond distance, the one before it starts the segment
+	int lo = 1, hi = route->count;
+
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+
+		if (route->distance[mid] > distance) hi = mid;
+		else lo = mid + 1;
+	}
+
+	return lo < route->count ? lo - 1 : -1;
+}
+
+
+void route_point_at(const route_t* route, float distance, vec3 point)
+{
+	int i = route_at_distance(route, distance);
+
+	if (i < 0)
+	{ // past the end
+		i = route->count - 1;
+		point[0] = route->x[i];
+		point[1] = route->y[i];
+		point[2] = route->z[i];
+		return;
+	}
+
+	float seg = route->distance[i + 1] - route->distance[i];
+	float t = seg > 0 ? (distance - route->distance[i]) / seg : 0;
+	t = MAX(0, MIN(t, 1));
+
+	point[0] = route->x[i] + (route->x[i + 1] - route->x[i]) * t;
+	point[1] = route->y[i] + (route->y[i + 1] - route->y[i]) * t;
+	point[2] = route->z[i] + (route->z[i + 1] - route->z[i]) * t;
+}
+
+
+float route_progress(const route_t* route, int i, const vec3 position)
+{
+	if (i >= route->count - 1) return route->distance[route->count - 1];
+
+	vec3 seg = {
+		route->x[i + 1] - route->x[i],
+		route->y[i + 1] - route->y[i],
+		route->z[i + 1] - route->z[i],
+	};
+	vec3 delta = {
+		position[0] - route->x[i],
+		position[1] - route->y[i],
+		position[2] - route->z[i],
+	};
+
+	float len = route->distance[i + 1] - route->distance[i];
+	if (len <= 0) return route->distance[i];
+
+	float along = vec3_mul_inner(delta, seg) / len;
+
+	return route->distance[i] + MAX(0, MIN(along, len));
+}
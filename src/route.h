@@ -0,0 +1,120 @@
+#ifndef AVC_ROUTE
+#define AVC_ROUTE
+
+#include <inttypes.h>
+#include "structs.h"
+
+#define ROUTE_MAGIC   0x54525641 // 'AVRT'
+#define ROUTE_VERSION 1
+#define ROUTE_ALIGN   64
+#define ROUTE_ARRAYS  8
+
+// waypoints ahead of the current one scanned before the grid is used
+#define ROUTE_WINDOW 64
+
+// waypoints closer than this to the car are considered reached
+#define ROUTE_REACHED 0.5f
+
+/**
+ * @brief Header of a route file, followed by the float [count] arrays of
+ *        route_t from x to distance, each starting on a ROUTE_ALIGN
+ *        boundary. All values are little endian.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t reserved;
+	uint64_t size;               // of the whole file
+	uint64_t off[ROUTE_ARRAYS]; // from the start of the file
+} route_hdr_t;
+
+/**
+ * @brief Waypoints of a route stored as a structure of arrays, plus a
+ *        uniform grid over x and y to find the ones near a position.
+ */
+typedef struct {
+	int count;
+	float* x;  // [count] positions
+	float* y;
+	float* z;
+	float* hx; // [count] headings
+	float* hy;
+	float* hz;
+	float* velocity; // [count]
+	float* distance; // [count] length of the route up to each waypoint
+
+	void* map;   // NULL when the arrays were allocated
+	size_t size;
+
+	struct {
+		float min_x, min_y; // corner of cell 0, 0
+		float cell;         // side of a cell
+		int w, h;
+		int* start; // [w * h + 1] where each cell's waypoints begin in index
+		int* index; // [count] waypoints ordered by cell, ascending in each
+	} grid;
+} route_t;
+
+/**
+ * @brief Builds a route from an array of waypoints, their next pointers
+ *        are ignored.
+ * @return 0 on success
+ */
+int route_init(route_t* route, const waypoint_t* waypoints, int count);
+
+/**
+ * @brief Maps a route file written by route_save(), the arrays point into
+ *        the mapping so only the grid is built.
+ * @return 0 on success
+ */
+int route_map(route_t* route, const char* path);
+
+/**
+ * @brief Loads a route file, mapping it if it's one route_save() wrote,
+ *        otherwise reading it as the legacy plain array of waypoint_t.
+ * @return 0 on success
+ */
+int route_load(route_t* route, const char* path);
+
+/**
+ * @brief Writes the route in the format route_map() reads. The file is
+ *        written next to path then renamed over it.
+ * @return 0 on success
+ */
+int route_save(const route_t* route, const char* path);
+
+/**
+ * @brief Unmaps or frees the route's arrays and grid.
+ */
+void route_release(route_t* route);
+
+/**
+ * @brief Finds the waypoint at or after 'from' with the lowest cost to
+ *        steer for, its distance plus 1 - the cosine between heading and
+ *        the direction to it. Waypoints within ROUTE_REACHED are skipped.
+ * @return index of the best waypoint, 'from' if none is better, or -1 once
+ *         the last waypoint is reached
+ */
+int route_best(const route_t* route, int from, const vec3 position, const vec3 heading);
+
+/**
+ * @brief Finds the waypoint starting the segment of the route that lies
+ *        distance along it, by binary search.
+ * @return its index, or -1 if the route is shorter
+ */
+int route_at_distance(const route_t* route, float distance);
+
+/**
+ * @brief Interpolates the point distance along the route, clamped to its
+ *        first and last waypoints.
+ */
+void route_point_at(const route_t* route, float distance, vec3 point);
+
+/**
+ * @brief Projects position onto the segment starting at waypoint i.
+ * @return how far along the route the projected point is
+ */
+float route_progress(const route_t* route, int i, const vec3 position);
+
+#endif
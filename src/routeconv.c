@@ -0,0 +1,54 @@
+#include "sys.h"
+#include "structs.h"
+#include "route.h"
+
+char* IN_PATH;
+char* OUT_PATH;
+
+
+int main(int argc, char* const argv[])
+{
+	PROC_NAME = argv[0];
+
+	cli_cmd_t cmds[] = {
+		{ 'i',
+			.desc = "Legacy route file to convert, a plain array of waypoint_t",
+			.usage = "-i [route_file]",
+			.opts = { .has_value = 1 },
+			.set = &IN_PATH,
+			.type = ARG_TYP_STR,
+		},
+		{ 'o',
+			.desc = "Path to write the converted route to",
+			.usage = "-o [route_file]",
+			.opts = { .has_value = 1 },
+			.set = &OUT_PATH,
+			.type = ARG_TYP_STR,
+		},
+		{}
+	};
+
+	if (cli("Converts a legacy route into the format the predictor maps", cmds, argc, argv))
+	{
+		return -1;
+	}
+
+	if (!IN_PATH || !OUT_PATH)
+	{
+		b_bad("Both -i and -o are required");
+		return -1;
+	}
+
+	route_t route;
+
+	if (route_load(&route, IN_PATH) || route_save(&route, OUT_PATH))
+	{
+		return -2;
+	}
+
+	route_release(&route);
+
+	b_good("Wrote '%s'", OUT_PATH);
+
+	return 0;
+}
@@ -113,6 +113,7 @@ void poll_ctrl_pipe(int sock)
 
 int main (int argc, char* argv[])
 {
+	PROC_NAME = argv[0];
 	std::ifstream i("scene.json");
 
 	seen::RendererGL renderer("./data", "Sim", FRAME_W >> 1, FRAME_H >> 1, 4, 0);
@@ -237,7 +238,9 @@ int main (int argc, char* argv[])
 	message_t msg = {
 		.header = {
 			.magic = MAGIC,
-			.type  = PAYLOAD_STATE
+			.type  = PAYLOAD_STATE,
+			.width = FRAME_W,
+			.height = FRAME_H,
 		},
 	};
 
@@ -300,6 +303,8 @@ int main (int argc, char* argv[])
 
 			color_t rgb_buf[FRAME_W * FRAME_H], tmp[FRAME_W * FRAME_H];
 			glReadPixels(0, 0, FRAME_W, FRAME_H, GL_RGB, GL_UNSIGNED_BYTE, (void*)tmp);
+			msg.header.seq++;
+			msg.header.capture_us = mono_us();
 
 			// Add clamped noise to the image
 			for (int i = FRAME_W * FRAME_H * 3; i--;)
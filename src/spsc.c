@@ -0,0 +1,96 @@
+#include "sys.h"
+#include "spsc.h"
+
+
+int spsc_init(spsc_t* q, uint32_t size)
+{
+	memset(q, 0, sizeof(spsc_t));
+
+	if (!size || (size & (size - 1))) return -1;
+
+	q->slots = (message_t**)calloc(size, sizeof(message_t*));
+	if (!q->slots) return -2;
+
+	q->mask = size - 1;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->ready, NULL);
+
+	return 0;
+}
+
+
+int spsc_push(spsc_t* q, message_t* msg)
+{
+	uint32_t head = q->head;
+	uint32_t depth = head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+	if (depth > q->mask) return -1;
+
+	q->slots[head & q->mask] = msg;
+
+	// sequentially consistent with the consumer's 'waiting' store, so
+	// either it sees the new head or we see it waiting
+	__atomic_store_n(&q->head, head + 1, __ATOMIC_SEQ_CST);
+
+	if (msg)
+	{
+		q->stats.pushes++;
+		q->stats.depth_sum += depth + 1;
+		if (depth + 1 > q->stats.depth_max) q->stats.depth_max = depth + 1;
+	}
+
+	if (__atomic_load_n(&q->waiting, __ATOMIC_SEQ_CST))
+	{
+		pthread_mutex_lock(&q->lock);
+		pthread_cond_signal(&q->ready);
+		pthread_mutex_unlock(&q->lock);
+	}
+
+	return 0;
+}
+
+
+int spsc_try_pop(spsc_t* q, message_t** msg)
+{
+	uint32_t tail = q->tail;
+
+	if (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == tail) return -1;
+
+	*msg = q->slots[tail & q->mask];
+	__atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+
+message_t* spsc_pop(spsc_t* q)
+{
+	message_t* msg;
+
+	while (spsc_try_pop(q, &msg))
+	{
+		pthread_mutex_lock(&q->lock);
+		__atomic_store_n(&q->waiting, 1, __ATOMIC_SEQ_CST);
+
+		if (__atomic_load_n(&q->head, __ATOMIC_SEQ_CST) == q->tail)
+		{
+			pthread_cond_wait(&q->ready, &q->lock);
+		}
+
+		__atomic_store_n(&q->waiting, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&q->lock);
+	}
+
+	return msg;
+}
+
+
+void spsc_log_stats(spsc_t* q, const char* name)
+{
+	b_log("%s queue: %" PRIu64 " pushed, depth avg %0.2f max %u",
+		name,
+		q->stats.pushes,
+		q->stats.pushes ? q->stats.depth_sum / (double)q->stats.pushes : 0,
+		q->stats.depth_max
+	);
+}
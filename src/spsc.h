@@ -0,0 +1,62 @@
+#ifndef AVC_SPSC
+#define AVC_SPSC
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "structs.h"
+
+/**
+ * @brief Single producer, single consumer queue of message pointers. Push
+ *        and pop are lock free, the lock and condition are only used when
+ *        the consumer has to sleep on an empty queue.
+ */
+typedef struct {
+	message_t** slots;
+	uint32_t mask;
+	uint32_t head; // next slot to write, only the producer moves it
+	uint32_t tail; // next slot to read, only the consumer moves it
+	int waiting;   // consumer is asleep, or about to be
+
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+
+	// kept by the producer
+	struct {
+		uint64_t pushes;
+		uint64_t depth_sum;
+		uint32_t depth_max;
+	} stats;
+} spsc_t;
+
+/**
+ * @brief Initializes an empty queue.
+ * @param q - queue to initialize
+ * @param size - capacity, a power of two
+ * @return 0 on success
+ */
+int spsc_init(spsc_t* q, uint32_t size);
+
+/**
+ * @brief Appends msg, which may be NULL. Never blocks.
+ * @return 0 on success, -1 if the queue is full
+ */
+int spsc_push(spsc_t* q, message_t* msg);
+
+/**
+ * @brief Removes the oldest entry if there is one.
+ * @return 0 on success, -1 if the queue is empty
+ */
+int spsc_try_pop(spsc_t* q, message_t** msg);
+
+/**
+ * @brief Removes the oldest entry, waiting for one if the queue is empty.
+ */
+message_t* spsc_pop(spsc_t* q);
+
+/**
+ * @brief Logs the average and max depth seen by the producer.
+ */
+void spsc_log_stats(spsc_t* q, const char* name);
+
+#endif
@@ -12,6 +12,9 @@
 	exit(-1);\
 }\
 
+// the largest frame a view holds. Streams carry the size of their frames
+// in the header, smaller ones sit at the view's top left with their rows
+// still FRAME_W pixels apart
 #define FRAME_W 352
 #define FRAME_H 240
 #define PIX_DEPTH 3
@@ -59,6 +62,11 @@ typedef struct {
 	uint8_t throttle, steering;
 } raw_action_t;
 
+typedef struct {
+	uint8_t luma[LUMA_PIXELS];
+	chroma_t chroma[CHRO_PIXELS];
+} view_t;
+
 typedef struct {
 	int16_t  rot_rate[3];
 	int16_t  acc[3];
@@ -66,10 +74,7 @@ typedef struct {
 	float    distance;
 	vec3     heading;
 	vec3     position;
-	struct {
-		uint8_t luma[LUMA_PIXELS];
-		chroma_t chroma[CHRO_PIXELS];
-	} view;
+	view_t   view;
 } raw_state_t;
 
 
@@ -94,29 +99,105 @@ typedef struct {
  * Payloads
  */
 
+// Upper 32 bits of the magic identify the stream, the lower 32 carry the
+// wire format version. Recordings made before the format was versioned
+// hold a 32 bit checksum of this file instead, see LEGACY_MAGIC().
+#define AVC_WIRE_SIG     0x41564300 // 'AVC\0'
+#define AVC_WIRE_VERSION 4
+#define MAGIC ((((uint64_t)AVC_WIRE_SIG) << 32) | AVC_WIRE_VERSION)
+#define LEGACY_MAGIC(m) (((m) >> 32) == 0)
+
 typedef enum {
 	PAYLOAD_STATE  = 0x01,
 	PAYLOAD_ACTION = 0x02,
 	PAYLOAD_PAIR   = 0x03,
+	PAYLOAD_SHM    = 0x10, // descriptor, message lives in a shared ring slot
 } payload_type_t;
 
+typedef enum {
+	FIELD_ACTION    = 0x01, // raw_action_t
+	FIELD_TELEMETRY = 0x02, // raw_state_t up to, but excluding the view
+	FIELD_VIEW      = 0x04, // raw_state_t view
+	FIELD_TRACE     = 0x08, // trace_t, stage exit times
+	FIELD_ALL       = 0x0F,
+	FIELD_VIEWS     = 0x10, // views_t, only sent when asked for explicitly
+} payload_field_t;
+
 typedef struct {
 	uint64_t magic;
 	payload_type_t type;
+	uint16_t fields;       // payload_field_t bits present in the payload
+	uint16_t reserved;
+	uint32_t payload_len;  // bytes following the header
+	uint32_t seq;          // v3: frame number assigned at capture
+	uint64_t capture_us;   // v3: CLOCK_MONOTONIC time of capture
+	uint16_t width;        // v4: frame size within the view, see FRAME_W
+	uint16_t height;
+	uint32_t reserved_v4;
 } dataset_hdr_t;
 
+#define TRACE_STAGES 8
+
+typedef struct {
+	char name[16];
+	uint64_t exit_us;      // CLOCK_MONOTONIC time the stage wrote the message
+} stage_stamp_t;
+
+typedef struct {
+	uint32_t count;
+	uint32_t reserved;
+	stage_stamp_t stages[TRACE_STAGES];
+} trace_t;
+
+// cameras a message can carry frames from, each beyond the first makes
+// every message with FIELD_VIEWS a frame larger
+#define VIEWS_MAX 2
+
+typedef struct {
+	uint32_t count;                   // views that follow the state's own
+	uint32_t reserved;
+	int64_t offset_us[VIEWS_MAX - 1]; // capture time relative to the state's view
+	view_t view[VIEWS_MAX - 1];
+} views_t;
+
+typedef struct {
+	uint64_t magic;
+	payload_type_t type;
+} legacy_hdr_t;
+
+// Fields are kept in the order they appear on the wire. This allows a
+// message_t to be allocated with only message_size() bytes when the
+// trailing fields are not needed. The views_t of FIELD_VIEWS isn't part of
+// it, it follows the message_t of those allocated with room for it, see
+// message_views().
 typedef struct {
 	dataset_hdr_t header;
-	union {
-		raw_state_t state;
+	struct {
+		trace_t trace;
 		raw_action_t action;
-		struct {
-			raw_action_t action;
-			raw_state_t state;
-		} pair;
+		raw_state_t state;
 	} payload;
 } message_t;
 
+/**
+ * Shared memory transport
+ */
+
+#define SHM_RING_SLOTS 4
+
+typedef struct {
+	char name[32];    // shm object containing the ring
+	uint64_t seq;     // sequence number of the slot to consume
+} shm_desc_t;
+
+typedef struct {
+	uint64_t magic;
+	uint32_t slots;
+	uint32_t slot_size;
+	uint64_t head;    // next sequence to be filled by the producer
+	uint64_t tail;    // next sequence to be released by the consumer
+} shm_ring_t;
+
 #define VEC_DIMENSIONS_F(v) (sizeof((v)) / sizeof(float))
 
 #endif
@@ -93,21 +93,6 @@ void b_bad(const char* fmt, ...)
 }
 
 
-void yuv422_to_rgb(uint8_t* luma, chroma_t* uv, color_t* rgb, int w, int h)
-{
-	for(int yi = h; yi--;)
-	for(int xi = w; xi--;)
-	{
-		int i = yi * w + xi;
-		int j = yi * (w >> 1) + (xi >> 1);
-
-		rgb[i].r = clamp(luma[i] + 1.14 * (uv[j].cb - 128));
-		rgb[i].g = clamp(luma[i] - 0.395 * (uv[j].cr - 128) - (0.581 * (uv[j].cb - 128)));
-		rgb[i].b = clamp(luma[i] + 2.033 * (uv[j].cr - 128));
-	}
-}
-
-
 float clamp(float v)
 {
 	v = v > 255 ? 255 : v;
@@ -219,87 +204,902 @@ done:
 }
 
 
-int write_pipeline_payload(message_t* msg)
+static const struct {
+	uint16_t bit;
+	size_t offset;
+	size_t size;
+} PAYLOAD_FIELDS[] = {
+	{ FIELD_TRACE,     offsetof(message_t, payload.trace),      sizeof(trace_t) },
+	{ FIELD_ACTION,    offsetof(message_t, payload.action),     sizeof(raw_action_t) },
+	{ FIELD_TELEMETRY, offsetof(message_t, payload.state),      offsetof(raw_state_t, view) },
+	{ FIELD_VIEW,      offsetof(message_t, payload.state.view), sizeof(view_t) },
+	{ FIELD_VIEWS,     sizeof(message_t),                       sizeof(views_t) },
+};
+#define PAYLOAD_FIELD_COUNT (sizeof(PAYLOAD_FIELDS) / sizeof(PAYLOAD_FIELDS[0]))
+
+
+static uint16_t payload_fields(payload_type_t type)
+{
+	switch (type)
+	{
+		case PAYLOAD_ACTION:
+			return FIELD_ACTION;
+		case PAYLOAD_STATE:
+			return FIELD_TELEMETRY | FIELD_VIEW;
+		case PAYLOAD_PAIR:
+			return FIELD_ALL;
+		default:
+			return 0;
+	}
+}
+
+
+static size_t payload_len(uint16_t fields)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < PAYLOAD_FIELD_COUNT; ++i)
+	{
+		if (fields & PAYLOAD_FIELDS[i].bit) len += PAYLOAD_FIELDS[i].size;
+	}
+
+	return len;
+}
+
+
+size_t message_size(uint16_t fields)
+{
+	size_t size = sizeof(dataset_hdr_t);
+
+	for (int i = 0; i < PAYLOAD_FIELD_COUNT; ++i)
+	{
+		if (fields & PAYLOAD_FIELDS[i].bit)
+		{
+			size = PAYLOAD_FIELDS[i].offset + PAYLOAD_FIELDS[i].size;
+		}
+	}
+
+	return size;
+}
+
+
+message_t* message_alloc(payload_type_t type, uint16_t fields)
+{
+	message_t* msg = (message_t*)calloc(1, message_size(fields));
+
+	if (msg)
+	{
+		msg->header.magic = MAGIC;
+		msg->header.type = type;
+		msg->header.fields = fields & payload_fields(type);
+		msg->header.width = FRAME_W;
+		msg->header.height = FRAME_H;
+	}
+
+	return msg;
+}
+
+
+views_t* message_views(message_t* msg)
+{
+	return (views_t*)(msg + 1);
+}
+
+
+void message_set_type(message_t* msg, payload_type_t type)
+{
+	msg->header.type = type;
+	msg->header.fields = payload_fields(type) | (msg->header.fields & FIELD_TRACE);
+}
+
+
+static size_t header_len(uint32_t version)
+{
+	// v2 headers ended before the capture time, with seq reserved, and v3
+	// ones before the frame size
+	if (version < 3) return offsetof(dataset_hdr_t, capture_us);
+	if (version < 4) return offsetof(dataset_hdr_t, width);
+	return sizeof(dataset_hdr_t);
+}
+
+
+// frames are packed YUYV, so an even number of pixels wide, and fit the view
+static int frame_size_valid(const dataset_hdr_t* hdr)
+{
+	return hdr->width && hdr->width <= FRAME_W && !(hdr->width & 1) &&
+	       hdr->height && hdr->height <= FRAME_H;
+}
+
+
+static pipeline_stats_t PIPE_STATS;
+static int PIPE_TIMEOUT_MS = -1;
+static int PIPE_LATEST;
+static size_t PIPE_LAST_WIRE_LEN; // bytes the last message took on stdin
+static size_t PIPE_IN_CAPACITY = SIZE_MAX;
+static int PIPE_HAS_INPUT; // set once by the reading thread, see trace_stamp()
+
+#if defined(__linux__) && !defined(F_SETPIPE_SZ)
+#define F_SETPIPE_SZ 1031
+#define F_GETPIPE_SZ 1032
+#endif
+
+// internal to the reader, the message was superseded by a newer one
+#define PIPE_STALE 1
+
+
+uint64_t mono_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+
+/**
+ * @brief Waits for fd to become ready for the events in 'events'.
+ * @param timeout_ms - How long to wait, -1 waits indefinitely.
+ * @return PIPE_OK when ready, PIPE_TIMEOUT or PIPE_CLOSED otherwise.
+ */
+static int wait_fd(int fd, short events, int timeout_ms, pipeline_counters_t* ctr)
+{
+	struct pollfd pfd = { fd, events, 0 };
+	uint64_t start = mono_us();
+	int res;
+
+	while ((res = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR);
+
+	ctr->stalls++;
+	ctr->stall_us += mono_us() - start;
+
+	if (res == 0) return PIPE_TIMEOUT;
+	if (res < 0) return PIPE_IO;
+
+	// a closed reader, or a hung up writer with nothing left to read
+	if (pfd.revents & POLLERR) return PIPE_CLOSED;
+	if (!(pfd.revents & events) && (pfd.revents & POLLHUP)) return PIPE_EOF;
+
+	return PIPE_OK;
+}
+
+
+static int read_full(int fd, void* dst, size_t len)
+{
+	uint8_t* buf = (uint8_t*)dst;
+
+	while (len)
+	{
+		ssize_t n = read(fd, buf, len);
+
+		if (n > 0)
+		{
+			buf += n;
+			len -= n;
+			PIPE_STATS.in.bytes += n;
+			continue;
+		}
+
+		if (n == 0) return PIPE_EOF;
+		if (errno == EINTR) continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK) return PIPE_IO;
+
+		// non-blocking stdin, the rest of the message is still in flight
+		int res = wait_fd(fd, POLLIN, -1, &PIPE_STATS.in);
+		if (res) return res;
+	}
+
+	return PIPE_OK;
+}
+
+
+static int discard_full(int fd, size_t len)
+{
+	uint8_t scratch[4096];
+
+	while (len)
+	{
+		size_t chunk = MIN(len, sizeof(scratch));
+		int res = read_full(fd, scratch, chunk);
+		if (res) return res;
+		len -= chunk;
+	}
+
+	return PIPE_OK;
+}
+
+
+static int write_full(int fd, struct iovec* iov, int iov_count)
+{
+	uint64_t start = mono_us();
+
+	while (iov_count)
+	{
+		ssize_t n = writev(fd, iov, iov_count);
+
+		if (n < 0)
+		{
+			if (errno == EINTR) continue;
+			if (errno == EPIPE) return PIPE_CLOSED;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) return PIPE_IO;
+
+			int res = wait_fd(fd, POLLOUT, -1, &PIPE_STATS.out);
+			if (res) return res;
+			continue;
+		}
+
+		PIPE_STATS.out.bytes += n;
+
+		// skip past what was written, the downstream reader may
+		// have taken only part of the message
+		while (iov_count && (size_t)n >= iov->iov_len)
+		{
+			n -= iov->iov_len;
+			++iov;
+			--iov_count;
+		}
+
+		if (iov_count)
+		{
+			iov->iov_base = (uint8_t*)iov->iov_base + n;
+			iov->iov_len -= n;
+			PIPE_STATS.out.partial++;
+		}
+	}
+
+	PIPE_STATS.out.blocked_us += mono_us() - start;
+	PIPE_STATS.out.messages++;
+
+	return PIPE_OK;
+}
+
+
+int pipeline_set_timeout(int timeout_ms)
+{
+	int flags = fcntl(0, F_GETFL);
+	if (flags < 0) return PIPE_IO;
+
+	flags = timeout_ms < 0 ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+	if (fcntl(0, F_SETFL, flags)) return PIPE_IO;
+
+	PIPE_TIMEOUT_MS = timeout_ms;
+
+	return PIPE_OK;
+}
+
+
+int pipeline_set_latest(int latest)
+{
+	struct stat st;
+
+	// draining relies on knowing what is queued in the pipe, which
+	// for a file would mean skipping straight to its end
+	if (latest && (fstat(0, &st) || !(S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode))))
+	{
+		b_log("stdin isn't a pipe, reading every message");
+		latest = 0;
+	}
+
+#ifdef F_SETPIPE_SZ
+	if (latest && S_ISFIFO(st.st_mode))
+	{
+		// Frames are larger than the default pipe, so the backlog
+		// would sit in the blocked writer instead of where we can
+		// drain it. Ask for room for a few, and take whatever we get.
+		fcntl(0, F_SETPIPE_SZ, 4 * message_size(FIELD_ALL));
+
+		int cap = fcntl(0, F_GETPIPE_SZ);
+		if (cap > 0) PIPE_IN_CAPACITY = cap;
+	}
+#endif
+
+	PIPE_LATEST = latest;
+
+	return PIPE_OK;
+}
+
+
+/**
+ * @brief Checks if a message like the last one read is queued up behind it.
+ *        A full pipe also counts, as the writer is then blocked part way
+ *        through a message it has already finished producing.
+ */
+static int newer_pending(int fd)
+{
+	int avail = 0;
+
+	if (ioctl(fd, FIONREAD, &avail)) return 0;
+
+	return avail >= MIN(PIPE_LAST_WIRE_LEN, PIPE_IN_CAPACITY);
+}
+
+
+const pipeline_stats_t* pipeline_stats(void)
+{
+	return &PIPE_STATS;
+}
+
+
+void pipeline_log_stats(void)
+{
+	const pipeline_counters_t* c[] = { &PIPE_STATS.in, &PIPE_STATS.out };
+	const char* names[] = { "in", "out" };
+
+	for (int i = 0; i < 2; ++i)
+	{
+		b_log("%s: %" PRIu64 " msgs %" PRIu64 "B, blocked %" PRIu64 "us, %" PRIu64 " stalls (%" PRIu64 "us), %" PRIu64 " partial, %" PRIu64 " dropped",
+			names[i],
+			c[i]->messages,
+			c[i]->bytes,
+			c[i]->blocked_us,
+			c[i]->stalls,
+			c[i]->stall_us,
+			c[i]->partial,
+			c[i]->dropped
+		);
+	}
+}
+
+
+static struct {
+	int enabled;
+	shm_desc_t desc;
+	shm_ring_t* ring;
+} SHM_OUT, SHM_IN;
+
+
+static uint8_t* shm_slot(shm_ring_t* ring, uint64_t seq)
+{
+	return (uint8_t*)(ring + 1) + (seq % ring->slots) * ring->slot_size;
+}
+
+
+static void shm_out_unlink(void)
+{
+	shm_unlink(SHM_OUT.desc.name);
+}
+
+
+static int shm_out_open(size_t slot_size)
 {
-	size_t expected_size = sizeof(dataset_hdr_t);
-	if (!msg) return -1;
+	struct stat st;
+	const char* transport = getenv(AVC_TRANSPORT_ENV);
+
+	SHM_OUT.enabled = -1;
+
+	// Only use the ring when explicitly asked to, and when stdout is
+	// actually a pipe. Redirecting to a file still records plain messages.
+	if (!transport || strcmp(transport, "shm")) return 0;
+	if (fstat(1, &st) || !S_ISFIFO(st.st_mode)) return 0;
+
+	snprintf(SHM_OUT.desc.name, sizeof(SHM_OUT.desc.name), "/avc.%d", getpid());
 
-	if (write(1, &msg->header, expected_size) != expected_size)
+	int fd = shm_open(SHM_OUT.desc.name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0)
 	{
+		b_bad("shm_open '%s' failed, using plain pipe", SHM_OUT.desc.name);
+		return -1;
+	}
+
+	size_t size = sizeof(shm_ring_t) + SHM_RING_SLOTS * slot_size;
+	if (ftruncate(fd, size))
+	{
+		close(fd);
+		shm_unlink(SHM_OUT.desc.name);
 		return -2;
 	}
 
+	void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (mem == MAP_FAILED)
+	{
+		shm_unlink(SHM_OUT.desc.name);
+		return -3;
+	}
+
+	SHM_OUT.ring = (shm_ring_t*)mem;
+	SHM_OUT.ring->magic = MAGIC;
+	SHM_OUT.ring->slots = SHM_RING_SLOTS;
+	SHM_OUT.ring->slot_size = slot_size;
+	SHM_OUT.enabled = 1;
+
+	// the consumer unlinks once it has mapped the ring, this
+	// covers the case where it never gets that far
+	atexit(shm_out_unlink);
+
+	return 0;
+}
+
+
+static int shm_in_attach(shm_desc_t* desc)
+{
+	if (SHM_IN.ring && !strncmp(SHM_IN.desc.name, desc->name, sizeof(desc->name)))
+	{
+		return 0;
+	}
+
+	int fd = shm_open(desc->name, O_RDWR, 0600);
+	if (fd < 0)
+	{
+		b_bad("Couldn't open shared ring '%s'", desc->name);
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < sizeof(shm_ring_t))
+	{
+		close(fd);
+		return -2;
+	}
+
+	void* mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	shm_unlink(desc->name);
+
+	if (mem == MAP_FAILED) return -3;
+
+	shm_ring_t* ring = (shm_ring_t*)mem;
+	if (ring->magic != MAGIC || ring->slot_size < sizeof(dataset_hdr_t))
+	{
+		b_bad("Shared ring '%s' has incorrect magic", desc->name);
+		munmap(mem, st.st_size);
+		return -4;
+	}
+
+	SHM_IN.ring = ring;
+	SHM_IN.desc = *desc;
+
+	return 0;
+}
+
+
+// wait for the consumer to release the slot for seq, giving up
+// if it goes away while we wait
+static int shm_wait_slot(shm_ring_t* ring, uint64_t seq)
+{
+	if (seq - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= ring->slots)
+	{
+		uint64_t start = mono_us();
+
+		while (seq - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= ring->slots)
+		{
+			struct pollfd pfd = { 1, POLLOUT, 0 };
+			if (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLERR))
+			{
+				return PIPE_CLOSED;
+			}
+
+			usleep(100);
+		}
+
+		PIPE_STATS.out.stalls++;
+		PIPE_STATS.out.stall_us += mono_us() - start;
+	}
+
+	return PIPE_OK;
+}
+
+
+static int shm_write(message_t* msg)
+{
+	shm_ring_t* ring = SHM_OUT.ring;
+	uint64_t seq = ring->head;
+	uint8_t* slot = shm_slot(ring, seq);
+	int res;
+
+	// the slots fit the fields of the first message, sent or claimed
+	if (message_size(msg->header.fields) > ring->slot_size)
+	{
+		b_bad("Message fields %x don't fit the shared ring's slots", msg->header.fields);
+		return PIPE_SHM;
+	}
+
+	if ((res = shm_wait_slot(ring, seq))) return res;
+
+	// messages built in place by way of pipeline_claim() are already there
+	if ((uint8_t*)msg != slot)
+	{
+		memcpy(slot, msg, message_size(msg->header.fields));
+	}
+	__atomic_store_n(&ring->head, seq + 1, __ATOMIC_RELEASE);
+
+	dataset_hdr_t hdr = {};
+	hdr.magic = MAGIC;
+	hdr.type = PAYLOAD_SHM;
+	hdr.payload_len = sizeof(shm_desc_t);
+	SHM_OUT.desc.seq = seq;
+
+	struct iovec iov[2] = {
+		{ &hdr, sizeof(hdr) },
+		{ &SHM_OUT.desc, sizeof(shm_desc_t) },
+	};
+
+	return write_full(1, iov, 2);
+}
+
+
+static int shm_release(shm_desc_t* desc)
+{
+	if (shm_in_attach(desc))
+	{
+		return PIPE_SHM;
+	}
+
+	__atomic_store_n(&SHM_IN.ring->tail, desc->seq + 1, __ATOMIC_RELEASE);
+
+	return PIPE_OK;
+}
+
+
+static int shm_read(message_t* msg, shm_desc_t* desc, uint16_t fields)
+{
+	if (shm_in_attach(desc))
+	{
+		return PIPE_SHM;
+	}
+
+	shm_ring_t* ring = SHM_IN.ring;
+	uint8_t* slot = shm_slot(ring, desc->seq);
+	dataset_hdr_t* hdr = (dataset_hdr_t*)slot;
+	size_t size = message_size(hdr->fields & fields);
+
+	if (size > ring->slot_size)
+	{
+		return PIPE_SHM;
+	}
+
+	memcpy(msg, slot, size);
+	msg->header.fields &= fields;
+
+	return shm_release(desc);
+}
+
+
+static void trace_stamp(message_t* msg)
+{
+	trace_t* trace = &msg->payload.trace;
+
+	// the first stage of the pipeline starts a new trace for every message.
+	// Readers and writers may be separate threads, so this doesn't look at
+	// the input counters which keep changing
+	if (!(msg->header.fields & FIELD_TRACE) || !PIPE_HAS_INPUT)
+	{
+		memset(trace, 0, sizeof(trace_t));
+		msg->header.fields |= FIELD_TRACE;
+	}
+
+	if (trace->count >= TRACE_STAGES) return;
+
+	const char* name = PROC_NAME ? PROC_NAME : "?";
+	const char* base = strrchr(name, '/');
+	stage_stamp_t* stamp = trace->stages + trace->count++;
+
+	snprintf(stamp->name, sizeof(stamp->name), "%s", base ? base + 1 : name);
+	stamp->exit_us = mono_us();
+}
+
+
+int write_pipeline_payload(message_t* msg)
+{
+	static int tracing = -1;
+	if (!msg) return PIPE_NULL_MSG;
+
+	if (tracing < 0)
+	{
+		const char* trace = getenv(AVC_TRACE_ENV);
+		tracing = trace && strcmp(trace, "") && strcmp(trace, "0");
+	}
+
+	dataset_hdr_t* hdr = &msg->header;
+	hdr->magic = MAGIC;
+
+	if (!(hdr->fields & ~FIELD_TRACE))
+	{
+		hdr->fields |= payload_fields(hdr->type);
+	}
+
+	if (tracing)
+	{
+		trace_stamp(msg);
+	}
+
+	if (!hdr->width || !hdr->height)
+	{
+		hdr->width = FRAME_W;
+		hdr->height = FRAME_H;
+	}
+
+	hdr->payload_len = payload_len(hdr->fields);
+
+	if (!SHM_OUT.enabled)
+	{
+		shm_out_open(message_size(hdr->fields));
+	}
+
+	if (SHM_OUT.enabled > 0)
+	{
+		return shm_write(msg);
+	}
+
+	struct iovec iov[1 + PAYLOAD_FIELD_COUNT] = {};
+	int iov_count = 1;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(dataset_hdr_t);
+
+	for (int i = 0; i < PAYLOAD_FIELD_COUNT; ++i)
+	{
+		if (!(hdr->fields & PAYLOAD_FIELDS[i].bit)) continue;
+
+		iov[iov_count].iov_base = (uint8_t*)msg + PAYLOAD_FIELDS[i].offset;
+		iov[iov_count].iov_len = PAYLOAD_FIELDS[i].size;
+		++iov_count;
+	}
+
+	return write_full(1, iov, iov_count);
+}
+
+
+message_t* pipeline_claim(uint16_t fields)
+{
+	if (!SHM_OUT.enabled)
+	{
+		shm_out_open(message_size(fields));
+	}
+
+	if (SHM_OUT.enabled <= 0) return NULL;
+
+	shm_ring_t* ring = SHM_OUT.ring;
+
+	if (message_size(fields) > ring->slot_size) return NULL;
+
+	if (shm_wait_slot(ring, ring->head)) return NULL;
+
+	return (message_t*)shm_slot(ring, ring->head);
+}
+
+
+static int read_legacy_payload(message_t* msg, uint16_t fields)
+{
+	// Legacy payloads were a union of the action, the state, and a pair
+	// with the state aligned after the action. Pairs were also written
+	// sizeof(raw_action_t) bytes short of their full size.
+	typedef struct {
+		raw_action_t action;
+		raw_state_t state;
+	} legacy_pair_t;
+
+	size_t action_len = 0, pad_len = 0, state_len = 0;
+	int res;
+
 	switch (msg->header.type)
 	{
 		case PAYLOAD_ACTION:
-			expected_size = sizeof(raw_action_t);
+			action_len = sizeof(raw_action_t);
 			break;
 		case PAYLOAD_STATE:
-			expected_size = sizeof(raw_state_t);
+			state_len = sizeof(raw_state_t);
 			break;
-		case PAYLOAD_PAIR:
-			expected_size = sizeof(raw_state_t) + sizeof(raw_action_t);
+		default:
+			action_len = sizeof(raw_action_t);
+			pad_len = offsetof(legacy_pair_t, state) - sizeof(raw_action_t);
+			state_len = sizeof(raw_action_t) + sizeof(raw_state_t) - offsetof(legacy_pair_t, state);
 			break;
 	}
 
-	if (write(1, &msg->payload, expected_size) != expected_size)
+	PIPE_LAST_WIRE_LEN += action_len + pad_len + state_len;
+
+	if (fields & FIELD_ACTION)
 	{
-		return -3;
+		res = read_full(0, &msg->payload.action, action_len);
+	}
+	else
+	{
+		res = discard_full(0, action_len);
 	}
 
-	return 0;
+	if (res || (res = discard_full(0, pad_len))) return res;
+
+	// the state is only read as far as the caller has room for
+	size_t cap = 0;
+	if (fields & (FIELD_TELEMETRY | FIELD_VIEW))
+	{
+		cap = message_size(fields) - offsetof(message_t, payload.state);
+		cap = MIN(cap, state_len);
+	}
+
+	if ((res = read_full(0, &msg->payload.state, cap))) return res;
+
+	return discard_full(0, state_len - cap);
 }
 
 
-int read_pipeline_payload(message_t* msg, payload_type_t exp_type)
+static int read_message(message_t* msg, payload_type_t exp_type, uint16_t fields)
 {
-	size_t expected_size = sizeof(dataset_hdr_t);
-	if (!msg) return -1;
+	dataset_hdr_t* hdr = &msg->header;
+	uint64_t start = mono_us();
+	int res;
 
-	if (read(0, &msg->header, expected_size) != expected_size)
+	// the deadline only applies while waiting for a message to begin,
+	// once it has, the rest is read in full
+	if (PIPE_TIMEOUT_MS >= 0)
 	{
-		return -2;
+		res = wait_fd(0, POLLIN, PIPE_TIMEOUT_MS, &PIPE_STATS.in);
+		if (res) return res;
 	}
 
-	if (msg->header.magic != MAGIC)
+	// all header versions begin with the legacy header
+	if ((res = read_full(0, hdr, sizeof(legacy_hdr_t))))
+	{
+		return res;
+	}
+
+	PIPE_STATS.in.blocked_us += mono_us() - start;
+	PIPE_STATS.in.messages++;
+	if (!PIPE_HAS_INPUT) PIPE_HAS_INPUT = 1;
+
+	int legacy = LEGACY_MAGIC(hdr->magic);
+	uint32_t version = legacy ? 0 : (uint32_t)hdr->magic;
+	PIPE_LAST_WIRE_LEN = legacy ? sizeof(legacy_hdr_t) : header_len(version);
+
+	if (legacy)
+	{
+		static int warned;
+		if (!warned++) b_log("Reading legacy message format");
+
+		hdr->fields = payload_fields(hdr->type);
+		hdr->payload_len = 0;
+	}
+	else if ((hdr->magic >> 32) != AVC_WIRE_SIG || version > AVC_WIRE_VERSION)
 	{
 		b_bad(
 			"Incorrect magic number got: %lx expected %lx",
-			msg->header.magic,
+			hdr->magic,
 			MAGIC
 		);
-		return -4;
+		return PIPE_MAGIC;
+	}
+	else if ((res = read_full(0, (uint8_t*)hdr + sizeof(legacy_hdr_t), header_len(version) - sizeof(legacy_hdr_t))))
+	{
+		return res;
 	}
 
-	if (!(msg->header.type & exp_type))
+	if (version < 3)
 	{
-		b_bad("Incompatible msg type %lx, expected %lx", msg->header.type, exp_type);
-		return -5;
+		// older formats carry no capture information
+		hdr->seq = 0;
+		hdr->capture_us = 0;
 	}
 
-	switch (msg->header.type)
+	if (version < 4)
 	{
-		case PAYLOAD_ACTION:
-			expected_size = sizeof(raw_action_t);
-			break;
-		case PAYLOAD_STATE:
-			expected_size = sizeof(raw_state_t);
-			break;
-		case PAYLOAD_PAIR:
-			expected_size = sizeof(raw_action_t) + sizeof(raw_state_t);
-			break;
+		// frames always filled the view before their size was sent
+		hdr->width = FRAME_W;
+		hdr->height = FRAME_H;
+	}
+
+	if (hdr->type == PAYLOAD_SHM)
+	{
+		shm_desc_t desc;
+
+		if (hdr->payload_len != sizeof(desc))
+		{
+			return PIPE_FORMAT;
+		}
+
+		if ((res = read_full(0, &desc, sizeof(desc))))
+		{
+			return res;
+		}
+
+		PIPE_LAST_WIRE_LEN += sizeof(desc);
+
+		// don't bother copying a slot that's already been superseded
+		if (PIPE_LATEST && newer_pending(0))
+		{
+			return (res = shm_release(&desc)) ? res : PIPE_STALE;
+		}
+
+		// the slot carries the real header and payload
+		if ((res = shm_read(msg, &desc, fields)))
+		{
+			return res;
+		}
+
+		if (!frame_size_valid(hdr))
+		{
+			return PIPE_FORMAT;
+		}
+
+		PIPE_STATS.in.bytes += message_size(hdr->fields);
+
+		if (!(hdr->type & exp_type))
+		{
+			b_bad("Incompatible msg type %lx, expected %lx", hdr->type, exp_type);
+			return PIPE_TYPE;
+		}
+
+		return PIPE_OK;
+	}
+
+	if (!(hdr->type & exp_type))
+	{
+		b_bad("Incompatible msg type %lx, expected %lx", hdr->type, exp_type);
+		return PIPE_TYPE;
 	}
 
-	size_t needed = expected_size;
-	off_t  off = 0;
-	uint8_t* buf = (uint8_t*)&msg->payload;
+	if (!frame_size_valid(hdr))
+	{
+		return PIPE_FORMAT;
+	}
 
-	while(needed)
+	if (legacy)
 	{
-		size_t gotten = read(0, buf + off, needed);
-		needed -= gotten;
-		off += gotten;
+		res = read_legacy_payload(msg, fields);
+		hdr->fields &= fields;
+		return res;
 	}
 
-	return 0;
+	// the known fields must fit in the payload, otherwise reading them
+	// would run into the next message
+	size_t consumed = payload_len(hdr->fields);
+
+	if (consumed > hdr->payload_len)
+	{
+		return PIPE_FORMAT;
+	}
+
+	// read the fields the caller has room for, skip the rest along
+	// with any fields this version doesn't know about
+	for (int i = 0; i < PAYLOAD_FIELD_COUNT; ++i)
+	{
+		if (!(hdr->fields & PAYLOAD_FIELDS[i].bit)) continue;
+
+		if (fields & PAYLOAD_FIELDS[i].bit)
+		{
+			res = read_full(0, (uint8_t*)msg + PAYLOAD_FIELDS[i].offset, PAYLOAD_FIELDS[i].size);
+		}
+		else
+		{
+			res = discard_full(0, PAYLOAD_FIELDS[i].size);
+		}
+
+		if (res) return res;
+	}
+
+	PIPE_LAST_WIRE_LEN += hdr->payload_len;
+
+	hdr->fields &= fields;
+
+	return discard_full(0, hdr->payload_len - consumed);
+}
+
+
+int read_pipeline_fields(message_t* msg, payload_type_t exp_type, uint16_t fields)
+{
+	if (!msg) return PIPE_NULL_MSG;
+
+	int res;
+
+	do
+	{
+		res = read_message(msg, exp_type, fields);
+
+		// in latest mode keep reading while another message
+		// is already queued up behind this one
+		if (res == PIPE_OK && PIPE_LATEST && newer_pending(0))
+		{
+			res = PIPE_STALE;
+		}
+
+		if (res == PIPE_STALE) PIPE_STATS.in.dropped++;
+	}
+	while (res == PIPE_STALE);
+
+	return res;
+}
+
+
+int read_pipeline_payload(message_t* msg, payload_type_t exp_type)
+{
+	return read_pipeline_fields(msg, exp_type, FIELD_ALL);
 }
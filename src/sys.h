@@ -4,7 +4,11 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <limits.h>
 #include <math.h>
 #include <assert.h>
@@ -18,8 +22,11 @@
 #include <getopt.h>
 #include <sched.h>
 #include <pthread.h>
+#include <poll.h>
+#include <time.h>
 
 #include "structs.h"
+#include "yuv.h"
 
 #define AVC_TERM_GREEN "\033[0;32m"
 #define AVC_TERM_RED "\033[1;31m"
@@ -27,6 +34,15 @@
 
 #define ACTION_CAL_PATH "actions.cal"
 
+// set to "shm" to pass messages between stages through a shared ring
+#define AVC_TRANSPORT_ENV "AVC_TRANSPORT"
+
+// set to 1 for every stage to append its exit time to the messages it writes
+#define AVC_TRACE_ENV "AVC_TRACE"
+
+// core the collector's pose estimator runs on exclusively
+#define POSE_CPU 3
+
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
@@ -63,20 +79,64 @@ typedef struct {
 	uint32_t interval_us;
 } timegate_t;
 
+typedef enum {
+	PIPE_OK       =  0,
+	PIPE_NULL_MSG = -1,
+	PIPE_EOF      = -2, // upstream closed its end
+	PIPE_FORMAT   = -3, // payload doesn't match its header
+	PIPE_MAGIC    = -4,
+	PIPE_TYPE     = -5,
+	PIPE_SHM      = -6, // shared ring couldn't be used
+	PIPE_IO       = -7,
+	PIPE_TIMEOUT  = -8, // no message began before the deadline
+	PIPE_CLOSED   = -9, // downstream closed its end
+} pipe_res_t;
+
+typedef struct {
+	uint64_t messages;
+	uint64_t bytes;
+	uint64_t blocked_us; // time spent waiting on the other end of the pipe
+	uint64_t stalls;     // times a transfer had to poll or wait for a ring slot
+	uint64_t stall_us;
+	uint64_t partial;    // writes the reader only took part of
+	uint64_t dropped;    // stale messages skipped in latest mode
+} pipeline_counters_t;
+
+typedef struct {
+	pipeline_counters_t in, out;
+} pipeline_stats_t;
+
 void b_log(const char* fmt, ...);
 void b_good(const char* fmt, ...);
 void b_bad(const char* fmt, ...);
 
 long diff_us(struct timeval then, struct timeval now);
+uint64_t mono_us(void);
 void timegate_open(timegate_t* tg);
 void timegate_close(timegate_t* tg);
 
+size_t message_size(uint16_t fields);
+message_t* message_alloc(payload_type_t type, uint16_t fields);
+void message_set_type(message_t* msg, payload_type_t type);
+// the extra cameras' frames, only there if msg was allocated with room
+// for FIELD_VIEWS
+views_t* message_views(message_t* msg);
+
 int write_pipeline_payload(message_t* msg);
+// slot of the shared ring the next message, carrying 'fields', will be
+// written to, for building it in place. The first write or claim sizes
+// the slots. NULL when writing to a plain pipe or the fields don't fit
+message_t* pipeline_claim(uint16_t fields);
 int read_pipeline_payload(message_t* msg, payload_type_t exp_type);
+int read_pipeline_fields(message_t* msg, payload_type_t exp_type, uint16_t fields);
+
+int pipeline_set_timeout(int timeout_ms);
+int pipeline_set_latest(int latest);
+const pipeline_stats_t* pipeline_stats(void);
+void pipeline_log_stats(void);
 
 int calib_load(const char* path, calib_t* cal);
 
-void yuv422_to_rgb(uint8_t* luma, chroma_t* uv, color_t* rgb, int w, int h);
 float clamp(float v);
 
 void cli_help(char* const argv[], const char* prog_desc, const char* cmds, const char* cmd_desc[]);
@@ -0,0 +1,216 @@
+#include "test.h"
+#include "sys.h"
+#include "model.h"
+
+#define PATCH_SIZE 16 // the predictor's
+#define HIDDEN 8
+#define FRAMES 6
+#define PREDICTOR "./bin/predictor"
+
+char DIR[64];
+
+
+static float frand(float range)
+{
+	return (random() % 20001 - 10000) / 10000.f * range;
+}
+
+
+static uint64_t align(uint64_t off)
+{
+	return (off + MODEL_ALIGN - 1) & ~(uint64_t)(MODEL_ALIGN - 1);
+}
+
+
+// a random two layer model the predictor can map, any classes will do as
+// long as they differ from patch to patch
+static int write_model(const char* path)
+{
+	const uint32_t in = PATCH_SIZE * PATCH_SIZE * 3;
+	model_hdr_t hdr = {
+		.magic = MODEL_MAGIC,
+		.version = MODEL_VERSION,
+		.layers = 2,
+		.input_scale = 1 / 255.f,
+		.input_offset = -0.5f,
+	};
+	model_layer_t layers[2] = {
+		{ .in = in, .out = HIDDEN, .activation = MODEL_ACT_RELU },
+		{ .in = HIDDEN, .out = 3, .activation = MODEL_ACT_SOFTMAX },
+	};
+
+	uint64_t off = sizeof(hdr) + sizeof(layers);
+	for (int i = 0; i < 2; ++i)
+	{
+		layers[i].w_off = off = align(off);
+		off += layers[i].in * layers[i].out * sizeof(float);
+		layers[i].b_off = off = align(off);
+		off += layers[i].out * sizeof(float);
+	}
+	hdr.size = off;
+
+	uint8_t* file = (uint8_t*)calloc(1, hdr.size);
+	if (!file) return -1;
+
+	memcpy(file, &hdr, sizeof(hdr));
+	memcpy(file + sizeof(hdr), layers, sizeof(layers));
+	for (int i = 0; i < 2; ++i)
+	{
+		float* w = (float*)(file + layers[i].w_off);
+		float* b = (float*)(file + layers[i].b_off);
+		for (uint32_t k = layers[i].in * layers[i].out; k--;) w[k] = frand(0.2f);
+		for (uint32_t k = layers[i].out; k--;) b[k] = frand(0.5f);
+	}
+
+	int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+	int res = fd < 0 || write(fd, file, hdr.size) != (ssize_t)hdr.size;
+	if (fd >= 0) close(fd);
+	free(file);
+
+	return -res;
+}
+
+
+// noisy frames of blocks that aren't aligned to the columns
+static int write_frames(const char* path)
+{
+	int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+	if (fd < 0) return -1;
+
+	int out = dup(1);
+	dup2(fd, 1);
+	close(fd);
+
+	message_t* msg = message_alloc(PAYLOAD_STATE, FIELD_ALL);
+	int res = msg ? 0 : -2;
+	for (int f = 0; !res && f < FRAMES; ++f)
+	{
+		view_t* view = &msg->payload.state.view;
+		for (int i = 0; i < LUMA_PIXELS; ++i)
+		{
+			int block = (i % FRAME_W) / 5 + (i / FRAME_W) / 7 * 3 + f;
+			view->luma[i] = (block * 37 + random() % 64) & 0xff;
+		}
+		for (int i = 0; i < CHRO_PIXELS; ++i)
+		{
+			view->chroma[i].cb = random() & 0xff;
+			view->chroma[i].cr = (i * 3 + f * 11) & 0xff;
+		}
+		res = write_pipeline_payload(msg);
+	}
+	free(msg);
+
+	dup2(out, 1);
+	close(out);
+
+	return res;
+}
+
+
+static int predict(int threads, char* out, size_t len)
+{
+	char cmd[512];
+
+	snprintf(out, len, "%s/j%d", DIR, threads);
+	snprintf(cmd, sizeof(cmd), PREDICTOR " -M %s -f -b 8 -j %d < %s/frames > %s 2>/dev/null",
+	         DIR, threads, DIR, out);
+
+	return system(cmd);
+}
+
+
+static int same_file(const char* a, const char* b, long* size)
+{
+	FILE* fa = fopen(a, "rb");
+	FILE* fb = fopen(b, "rb");
+	int res = !fa || !fb;
+	int ca = 0, cb = 0;
+
+	*size = 0;
+	while (!res && ca != EOF)
+	{
+		ca = fgetc(fa);
+		cb = fgetc(fb);
+		res = ca != cb;
+		*size += ca != EOF;
+	}
+
+	if (fa) fclose(fa);
+	if (fb) fclose(fb);
+
+	return !res;
+}
+
+
+static void cleanup(void)
+{
+	const char* files[] = { MODEL_FILE, "frames", "j1", "j4" };
+	char path[256];
+
+	if (!*DIR) return;
+
+	for (int i = 0; i < 4; ++i)
+	{
+		snprintf(path, sizeof(path), "%s/%s", DIR, files[i]);
+		unlink(path);
+	}
+	rmdir(DIR);
+}
+
+
+int narrow_columns_match(void)
+{
+	char path[256], single[256], pooled[256];
+	long size;
+
+	PROC_NAME = "avoider";
+
+	if (access(PREDICTOR, X_OK))
+	{
+		Log("%s has to be built first", 0, PREDICTOR);
+		return -1;
+	}
+
+	snprintf(DIR, sizeof(DIR), "/tmp/avoider.%d", getpid());
+	if (mkdir(DIR, 0777))
+	{
+		Log("Couldn't make %s", 0, DIR);
+		return -2;
+	}
+
+	snprintf(path, sizeof(path), "%s/" MODEL_FILE, DIR);
+	if (write_model(path))
+	{
+		Log("Writing %s failed", 0, path);
+		return -3;
+	}
+
+	snprintf(path, sizeof(path), "%s/frames", DIR);
+	if (write_frames(path))
+	{
+		Log("Writing %s failed", 0, path);
+		return -4;
+	}
+
+	// patches are wider than the columns so jobs share pixels at their edges
+	if (predict(1, single, sizeof(single)) || predict(4, pooled, sizeof(pooled)))
+	{
+		Log("The predictor failed", 0);
+		return -5;
+	}
+
+	if (!same_file(single, pooled, &size) || size < (long)(FRAMES * sizeof(dataset_hdr_t)))
+	{
+		Log("4 threads painted different frames than 1, after %ld bytes", 0, size);
+		return -6;
+	}
+
+	return 0;
+}
+
+TEST_BEGIN
+	.name = "Avoider threads",
+	.description = "Classifying columns narrower than a patch on several threads paints the same frames as on one.",
+	.run = narrow_columns_match,
+	.teardown = cleanup,
+TEST_END
@@ -0,0 +1,105 @@
+#include "test.h"
+#include "qdense.h"
+
+#define IN 768
+#define OUT 16
+#define ROWS 5
+
+int8_t A[IN + 64], B[IN + 64];
+
+
+int dots_match(void)
+{
+	const qdot_impl_t* scalar = NULL;
+
+	for (const qdot_impl_t* impl = QDOT_IMPLS; impl->name; ++impl)
+	{
+		if (!strcmp(impl->name, "scalar")) scalar = impl;
+	}
+
+	if (!scalar) return -1;
+
+	// extremes first, then random vectors of every length around the
+	// simd widths so tails and misaligned starts are covered
+	memset(A, -128, sizeof(A));
+	memset(B, -128, sizeof(B));
+
+	for (int run = 0; run < 64; ++run)
+	{
+		int n = run ? random() % IN : IN;
+		int off = run ? random() % 16 : 0;
+
+		for (const qdot_impl_t* impl = QDOT_IMPLS; impl->name; ++impl)
+		{
+			if (impl->supported && !impl->supported()) continue;
+
+			int32_t expected = scalar->dot(A + off, B + off, n);
+			int32_t actual = impl->dot(A + off, B + off, n);
+
+			if (expected != actual)
+			{
+				Log("%s: %d != %d for %d elements", 0, impl->name, actual, expected, n);
+				return -2;
+			}
+		}
+
+		for (int i = sizeof(A); i--;)
+		{
+			A[i] = random();
+			B[i] = random();
+		}
+	}
+
+	// a layer of the form qdense_load() produces against float math
+	int8_t w[OUT * IN], q[ROWS * IN];
+	float scale[OUT], bias[OUT], x_scale[ROWS], y[ROWS * OUT];
+	int32_t sum[OUT] = {};
+	qdense_t layer = { IN, OUT, scale, bias, sum, w };
+
+	for (int j = OUT; j--;)
+	{
+		scale[j] = (j + 1) / 1000.f;
+		bias[j] = j / 10.f - 0.5f;
+
+		for (int i = IN; i--;)
+		{
+			w[j * IN + i] = random() % 255 - 127;
+			sum[j] += w[j * IN + i];
+		}
+	}
+
+	for (int r = ROWS; r--;)
+	{
+		x_scale[r] = 1 / 255.f;
+		for (int i = IN; i--;) q[r * IN + i] = random();
+	}
+
+	qdense_forward(&layer, q, x_scale, 0.5f, ROWS, y);
+
+	for (int r = ROWS; r--;)
+	for (int j = OUT; j--;)
+	{
+		double expected = bias[j];
+
+		for (int i = IN; i--;)
+		{
+			expected += (q[r * IN + i] + 0.5) / 255.0 * w[j * IN + i] * scale[j];
+		}
+
+		if (fabs(expected - y[r * OUT + j]) > 1e-3)
+		{
+			Log("forward: row %d channel %d is %f expected %f", 0, r, j, y[r * OUT + j], expected);
+			return -3;
+		}
+	}
+
+	Log("using %s", 1, qdot_impl()->name);
+
+	return 0;
+}
+
+TEST_BEGIN
+	.name = "Int8 dense layer",
+	.description = "Every int8 dot product matches the scalar one and the layer matches float math.",
+	.run = dots_match,
+TEST_END
@@ -0,0 +1,105 @@
+#include "test.h"
+#include "route.h"
+
+#define MAX_N 4000
+
+waypoint_t WAYPOINTS[MAX_N];
+
+
+static float frand(float range)
+{
+	return (random() % 20001 - 10000) / 10000.f * range;
+}
+
+
+// every waypoint from 'from' on, lowest cost first then lowest index
+static int reference(const route_t* route, int from, const vec3 pos, const vec3 heading)
+{
+	vec3 delta;
+	int last = route->count - 1;
+	int best = from;
+	float lowest_cost = INFINITY;
+
+	vec3_sub(delta, WAYPOINTS[last].position, pos);
+	if (vec3_len(delta) <= ROUTE_REACHED) return -1;
+
+	for (int i = from; i < route->count; ++i)
+	{
+		vec3 dir;
+
+		vec3_sub(delta, WAYPOINTS[i].position, pos);
+		float dist = vec3_len(delta);
+		if (dist <= ROUTE_REACHED) continue;
+
+		vec3_norm(dir, delta);
+		float cost = dist + (2 - (vec3_mul_inner(dir, heading) + 1));
+
+		if (cost < lowest_cost)
+		{
+			best = i;
+			lowest_cost = cost;
+		}
+	}
+
+	return best;
+}
+
+
+int best_matches(void)
+{
+	for (int run = 0; run < 40; ++run)
+	{
+		int n = 1 + random() % MAX_N;
+		route_t route;
+
+		// a wandering track, sometimes a straight one, crossing itself
+		vec3 p = { 0, 0, 0 };
+		float yaw = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			yaw += run % 4 ? frand(0.3f) : 0;
+			p[0] += cosf(yaw) * 0.25f;
+			p[1] += sinf(yaw) * 0.25f;
+			memcpy(WAYPOINTS[i].position, p, sizeof(vec3));
+		}
+
+		if (route_init(&route, WAYPOINTS, n))
+		{
+			Log("route_init failed for %d waypoints", 0, n);
+			return -1;
+		}
+
+		for (int q = 0; q < 200; ++q)
+		{
+			int from = random() % n;
+			vec3 heading = { frand(1), frand(1), 0 };
+			vec3_norm(heading, heading);
+
+			// near the route most of the time, off somewhere else otherwise
+			const waypoint_t* near = WAYPOINTS + random() % n;
+			float spread = q % 5 ? 2 : 50;
+			vec3 pos = {
+				near->position[0] + frand(spread),
+				near->position[1] + frand(spread),
+				0,
+			};
+
+			int expected = reference(&route, from, pos, heading);
+			int actual = route_best(&route, from, pos, heading);
+
+			if (expected != actual)
+			{
+				Log("n %d from %d: best %d expected %d", 0, n, from, actual, expected);
+				return -2;
+			}
+		}
+	}
+
+	return 0;
+}
+
+TEST_BEGIN
+	.name = "Route waypoint search",
+	.description = "The windowed grid search finds the same waypoint as checking every one.",
+	.run = best_matches,
+TEST_END
@@ -0,0 +1,118 @@
+#include "test.h"
+#include "window.h"
+
+#define MAX_N 128
+
+float HIST[MAX_N];
+
+
+// the original double loop from avoider()
+static float reference(const float* hist, int n, float width_weight, int range[2])
+{
+	float best = hist[n - 1];
+	range[0] = range[1] = n;
+
+	for (int j = n + 1; j--;)
+	{
+		float cost = 0;
+
+		for (int i = j; i--;)
+		{
+			cost += hist[i];
+
+			float total_cost = cost / (1 + (j - i) * width_weight);
+			if (total_cost > best)
+			{
+				range[0] = i;
+				range[1] = j;
+				best = total_cost;
+			}
+		}
+	}
+
+	return best;
+}
+
+
+int windows_match(void)
+{
+	const float weights[] = { 1, 0.25f, 4 };
+
+	for (int run = 0; run < 2000; ++run)
+	{
+		int n = 1 + random() % MAX_N;
+		float w = weights[run % 3];
+
+		for (int i = n; i--;)
+		{
+			// mostly bad columns with some good ones, like the avoider's
+			HIST[i] = (random() % 2000 - 1400) / 100.f;
+		}
+
+		int expected_r[2], actual_r[2];
+		float expected = reference(HIST, n, w, expected_r);
+		float actual = window_best(HIST, n, w, actual_r);
+
+		// sums are accumulated differently, so only near ties may differ
+		if (fabs(expected - actual) > 1e-4 * (1 + fabs(expected)))
+		{
+			Log("n %d: score %f expected %f", 0, n, actual, expected);
+			return -1;
+		}
+
+		if (expected_r[0] != actual_r[0] || expected_r[1] != actual_r[1])
+		{
+			int r[2] = { actual_r[0], actual_r[1] };
+			float sum = 0;
+
+			for (int i = r[0]; i < r[1]; ++i) sum += HIST[i];
+
+			float score = r[0] == n ? HIST[n - 1] : sum / (1 + (r[1] - r[0]) * w);
+
+			if (fabs(score - expected) > 1e-4 * (1 + fabs(expected)))
+			{
+				Log("n %d: window [%d, %d) expected [%d, %d)", 0, n, r[0], r[1], expected_r[0], expected_r[1]);
+				return -2;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// patches of odd width buckets start on even columns, inside the frame
+int patches_aligned(void)
+{
+	const int widths[] = { 352, 176, 34 };
+	const int patch = 16;
+
+	for (int wi = 0; wi < 3; ++wi)
+	for (int bucket = 2; bucket <= widths[wi]; ++bucket)
+	for (int ci = 0; ci < widths[wi] / bucket; ++ci)
+	{
+		int w = widths[wi];
+		int x = window_patch_x(ci, bucket, w, patch);
+		int want = ci * bucket < w - patch ? ci * bucket : w - patch;
+
+		if ((x & 1) || x < 0 || x + patch > w || want - x > 1)
+		{
+			Log("%d wide frame, bucket %d column %d: patch at %d", 0, w, bucket, ci, x);
+			return -3;
+		}
+	}
+
+	return 0;
+}
+
+
+int window_checks(void)
+{
+	int res = windows_match();
+	return res ? res : patches_aligned();
+}
+
+TEST_BEGIN
+	.name = "Steering window search",
+	.description = "The hull based search finds the same best window as the original double loop, and column patches start on even pixels for any bucket width.",
+	.run = window_checks,
+TEST_END
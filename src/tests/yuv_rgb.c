@@ -0,0 +1,152 @@
+#include "test.h"
+#include "yuv.h"
+
+#define W 352
+#define H 240
+
+uint8_t LUMA[W * H];
+chroma_t CHROMA[W * H / 2];
+color_t EXPECTED[W * H], ACTUAL[W * H];
+
+
+static float clamp_ref(float v)
+{
+	v = v > 255 ? 255 : v;
+	return v < 0 ? 0 : v;
+}
+
+
+// original floating point conversion
+static void reference(void)
+{
+	for (int i = W * H; i--;)
+	{
+		int j = i >> 1;
+		EXPECTED[i].r = clamp_ref(LUMA[i] + 1.14 * (CHROMA[j].cb - 128));
+		EXPECTED[i].g = clamp_ref(LUMA[i] - 0.395 * (CHROMA[j].cr - 128) - (0.581 * (CHROMA[j].cb - 128)));
+		EXPECTED[i].b = clamp_ref(LUMA[i] + 2.033 * (CHROMA[j].cr - 128));
+	}
+}
+
+
+static void fill(int pattern)
+{
+	for (int i = W * H; i--;)
+	{
+		LUMA[i] = pattern ? (i * 7) & 0xFF : random();
+	}
+
+	for (int i = W * H / 2; i--;)
+	{
+		// extremes of chroma exercise the clamping
+		CHROMA[i].cb = pattern ? ((i & 1) ? 0 : 255) : random();
+		CHROMA[i].cr = pattern ? ((i & 2) ? 255 : 0) : random();
+	}
+}
+
+
+int convert_matches(void)
+{
+	const yuv_impl_t* scalar = NULL;
+
+	for (const yuv_impl_t* impl = YUV_IMPLS; impl->name; ++impl)
+	{
+		if (!strcmp(impl->name, "scalar")) scalar = impl;
+	}
+
+	if (!scalar) return -1;
+
+	for (int run = 0; run < 16; ++run)
+	{
+		fill(run == 0);
+
+		// the fixed point conversion stays within one step of the original
+		reference();
+		scalar->convert(LUMA, CHROMA, ACTUAL, W * H);
+
+		for (int i = W * H; i--;)
+		for (int c = 3; c--;)
+		{
+			if (abs(ACTUAL[i].v[c] - EXPECTED[i].v[c]) > 1)
+			{
+				Log("scalar: pixel %d channel %d is %d expected %d", 0, i, c, ACTUAL[i].v[c], EXPECTED[i].v[c]);
+				return -2;
+			}
+		}
+
+		memcpy(EXPECTED, ACTUAL, sizeof(ACTUAL));
+
+		// simd versions must agree with the scalar one exactly, odd lengths
+		// and offsets cover the tails and unaligned accesses
+		for (const yuv_impl_t* impl = YUV_IMPLS; impl->name; ++impl)
+		{
+			if (impl->supported && !impl->supported())
+			{
+				Log("%s: not supported, skipped", 1, impl->name);
+				continue;
+			}
+
+			int offset = (random() % 32) & ~1;
+			int pixels = W * H - offset - random() % 31;
+
+			memset(ACTUAL, 0, sizeof(ACTUAL));
+			impl->convert(LUMA + offset, CHROMA + offset / 2, ACTUAL + offset, pixels);
+
+			if (memcmp(ACTUAL + offset, EXPECTED + offset, pixels * sizeof(color_t)))
+			{
+				Log("%s: differs from scalar (offset %d, %d pixels)", 0, impl->name, offset, pixels);
+				return -3;
+			}
+
+			if (offset + pixels < W * H && (ACTUAL[offset + pixels].r || ACTUAL[offset + pixels].g || ACTUAL[offset + pixels].b))
+			{
+				Log("%s: wrote past %d pixels", 0, impl->name, pixels);
+				return -4;
+			}
+		}
+	}
+
+	// patches are the same pixels laid out as one row, r, g, b interleaved
+	float patch[16 * 16 * 3];
+	int8_t patch_q8[16 * 16 * 3];
+	yuv422_patch_f(LUMA, CHROMA, W, 64, 70, 16, patch);
+	yuv422_patch_q8(LUMA, CHROMA, W, 64, 70, 16, patch_q8);
+
+	for (int i = 16 * 16 * 3; i--;)
+	{
+		int p = i / 3, ch = i % 3;
+		const uint8_t* c = (const uint8_t*)(EXPECTED + (70 + p / 16) * W + 64 + p % 16);
+
+		if (patch[i] != c[ch] || patch_q8[i] != c[ch] - 128)
+		{
+			Log("patch: element %d is %f (%d) expected %d", 0, i, patch[i], patch_q8[i], c[ch]);
+			return -5;
+		}
+	}
+
+	// regions wider than the conversion scratch are done in chunks
+	static float region[3 * 150 * 3];
+	yuv422_region_f(LUMA, CHROMA, W, 10, 5, 150, 3, region);
+
+	for (int i = 3 * 150 * 3; i--;)
+	{
+		int p = i / 3, ch = i % 3;
+		const uint8_t* c = (const uint8_t*)(EXPECTED + (5 + p / 150) * W + 10 + p % 150);
+
+		if (region[i] != c[ch])
+		{
+			Log("region: element %d is %f expected %d", 0, i, region[i], c[ch]);
+			return -6;
+		}
+	}
+
+	Log("using %s", 1, yuv_impl()->name);
+
+	return 0;
+}
+
+TEST_BEGIN
+	.name = "YUV422 to RGB",
+	.description = "Every converter is bit exact with the scalar one, which is within one step of the float original. Patches match the frame conversion.",
+	.run = convert_matches,
+TEST_END
@@ -0,0 +1,110 @@
+#include "test.h"
+#include "yuv.h"
+
+#define W 352
+#define H 240
+#define BENCH_FRAMES 500
+
+uint32_t YUYV[W * H / 2 + 16];
+uint8_t EXPECTED_LUMA[W * H], LUMA[W * H + 64];
+chroma_t EXPECTED_CHROMA[W * H / 2], CHROMA[W * H / 2 + 32];
+
+
+// the loop poll_vision() used to split frames with
+static void reference(uint8_t* luma, chroma_t* chroma)
+{
+	for (int j = H; j--;)
+	{
+		uint32_t* row = YUYV + j * (W >> 1);
+		uint8_t* luma_row = luma + (j * W);
+		chroma_t* chroma_row = chroma + (j * (W >> 1));
+
+		for (int i = W / 2; i--;)
+		{
+			int li = i << 1;
+
+			luma_row[li + 0] = row[i] & 0xFF;
+			luma_row[li + 1] = (row[i] >> 16) & 0xFF;
+
+			chroma_row[i].cr = (row[i] >> 8) & 0xFF;
+			chroma_row[i].cb = (row[i] >> 24) & 0xFF;
+		}
+	}
+}
+
+
+static double frames_per_ms(void (*unpack)(const uint8_t*, uint8_t*, chroma_t*, int))
+{
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int f = BENCH_FRAMES; f--;)
+	{
+		if (unpack) unpack((const uint8_t*)YUYV, LUMA, CHROMA, W * H);
+		else reference(LUMA, CHROMA);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+	return BENCH_FRAMES / ms;
+}
+
+
+int unpack_matches(void)
+{
+	for (int i = sizeof(YUYV) / sizeof(uint32_t); i--;)
+	{
+		YUYV[i] = random() ^ (random() << 16);
+	}
+
+	reference(EXPECTED_LUMA, EXPECTED_CHROMA);
+
+	for (const yuv_impl_t* impl = YUV_IMPLS; impl->name; ++impl)
+	{
+		if (impl->supported && !impl->supported())
+		{
+			Log("%s: not supported, skipped", 1, impl->name);
+			continue;
+		}
+
+		// odd starts and lengths cover the tails and unaligned accesses
+		for (int run = 0; run < 32; ++run)
+		{
+			int offset = run ? (random() % 64) & ~1 : 0;
+			int pixels = run ? (W * H - offset - random() % 63) & ~1 : W * H;
+
+			memset(LUMA, 0, sizeof(LUMA));
+			memset(CHROMA, 0, sizeof(CHROMA));
+			impl->unpack((const uint8_t*)YUYV + offset * 2, LUMA, CHROMA, pixels);
+
+			if (memcmp(LUMA, EXPECTED_LUMA + offset, pixels) ||
+			    memcmp(CHROMA, EXPECTED_CHROMA + offset / 2, pixels / 2 * sizeof(chroma_t)))
+			{
+				Log("%s: differs from the original loop (offset %d, %d pixels)", 0, impl->name, offset, pixels);
+				return -1;
+			}
+
+			if (LUMA[pixels] || CHROMA[pixels / 2].cb || CHROMA[pixels / 2].cr)
+			{
+				Log("%s: wrote past %d pixels", 0, impl->name, pixels);
+				return -2;
+			}
+		}
+	}
+
+	// not a pass condition, but shows what each one buys over the original
+	Log("original loop: %0.2f frames/ms", 1, frames_per_ms(NULL));
+	for (const yuv_impl_t* impl = YUV_IMPLS; impl->name; ++impl)
+	{
+		if (impl->supported && !impl->supported()) continue;
+		Log("%s: %0.2f frames/ms", 1, impl->name, frames_per_ms(impl->unpack));
+	}
+
+	return 0;
+}
+
+TEST_BEGIN
+	.name = "YUYV unpacking",
+	.description = "Every implementation splits camera frames exactly like the original loop.",
+	.run = unpack_matches,
+TEST_END
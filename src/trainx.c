@@ -16,6 +16,7 @@ char FULL_PATH[PATH_MAX];
 struct {
 	int x1, y1, x2, y2;
 	int w, h;
+	int centered; // x1 and y1 follow the size of each frame
 } CAP_WIN;
 
 
@@ -31,6 +32,7 @@ static int arg_parse_capture_win(char f, char* v)
 	{
 		CAP_WIN.w = CAP_WIN.x2;
 		CAP_WIN.h = CAP_WIN.y2;
+		CAP_WIN.centered = 1;
 		CAP_WIN.x1 = (FRAME_W >> 1) - (CAP_WIN.w >> 1);
 		CAP_WIN.y1 = (FRAME_H >> 1) - (CAP_WIN.h >> 1);
 	}
@@ -196,20 +198,42 @@ int main (int argc,  char* const argv[])
 		}
 	}
 
+	message_t* msg = message_alloc(PAYLOAD_PAIR, FIELD_ALL);
+	assert(msg);
+
 	while (RUNNING)
 	{
-		message_t msg = {};
 		color_t rgb[FRAME_W * FRAME_H];
 		color_t cap[CAP_WIN.w * CAP_WIN.h];
 
-		if (read_pipeline_payload(&msg, PAYLOAD_PAIR))
+		int res = read_pipeline_payload(msg, PAYLOAD_PAIR);
+		if (res == PIPE_EOF)
+		{
+			break;
+		}
+		else if (res)
 		{
 			b_bad("Read error");
 			return -5;
 		}
 
-		raw_state_t* state = &msg.payload.state;
-		yuv422_to_rgb(state->view.luma, state->view.chroma, rgb, FRAME_W, FRAME_H);
+		const int frame_w = msg->header.width, frame_h = msg->header.height;
+
+		if (CAP_WIN.centered)
+		{
+			CAP_WIN.x1 = (frame_w >> 1) - (CAP_WIN.w >> 1);
+			CAP_WIN.y1 = (frame_h >> 1) - (CAP_WIN.h >> 1);
+		}
+
+		if (CAP_WIN.x1 < 0 || CAP_WIN.y1 < 0 || CAP_WIN.x1 + CAP_WIN.w > frame_w || CAP_WIN.y1 + CAP_WIN.h > frame_h)
+		{
+			b_bad("The capture window doesn't fit in %dx%d frames", frame_w, frame_h);
+			return -6;
+		}
+
+		// rows stay FRAME_W pixels apart however narrow the frame
+		raw_state_t* state = &msg->payload.state;
+		yuv422_to_rgb(state->view.luma, state->view.chroma, rgb, FRAME_W, frame_h);
 		// int rf = open("/dev/random", O_RDONLY);
 		// read(rf, rgb, sizeof(rgb));
 		// close(rf);
@@ -239,7 +263,7 @@ int main (int argc,  char* const argv[])
 
 		if (FORWARD_STATE)
 		{
-			if (write_pipeline_payload(&msg))
+			if (write_pipeline_payload(msg))
 			{
 				b_bad("Failed to write payload");
 				return -1;
@@ -18,6 +18,7 @@
 
 GLFWwindow* WIN;
 GLuint frameTex;
+int LATEST_ONLY;
 
 static void setupGL()
 {
@@ -77,11 +78,26 @@ int main(int argc, char* argv[])
 {
 	PROC_NAME = argv[0];
 
+	cli_cmd_t cmds[] = {
+		{ 'l',
+			.desc = "Only display the latest frame, dropping any that queued up",
+			.set = &LATEST_ONLY,
+		},
+		{}
+	};
+
+	if (cli("Displays the video and path of a state stream read over stdin", cmds, argc, argv))
+	{
+		return -1;
+	}
+
+	pipeline_set_latest(LATEST_ONLY);
+
 	if (!glfwInit()){
 		return -1;
 	}
 
-	b_log("Magic %d\n", MAGIC);
+	b_log("Wire format v%d\n", AVC_WIRE_VERSION);
 
 	WIN = glfwCreateWindow(640, 480, "AVC 2017", NULL, NULL);
 
@@ -96,15 +112,19 @@ int main(int argc, char* argv[])
 
 	color_t rgb[FRAME_W * FRAME_H] = {};
 	message_t msg = {};
+	int frame_w = FRAME_W, frame_h = FRAME_H;
+
+	// frames smaller than the view keep its row length
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, FRAME_W);
 
 	vec3 positions[1024];
 	int pos_idx = 0;
 	int use_sleep = 0;
 	int img_fd = 0;
 
-	if(argc >= 2)
+	if(optind < argc)
 	{
-		img_fd = open(argv[1], O_RDONLY);
+		img_fd = open(argv[optind], O_RDONLY);
 		//use_sleep = 1;
 	}
 
@@ -115,29 +135,28 @@ int main(int argc, char* argv[])
 			GL_TEXTURE_2D,
 			0,
 			GL_RGB,
-			FRAME_W,
-			FRAME_H,
+			frame_w,
+			frame_h,
 			0,
 			GL_RGB,
 			GL_UNSIGNED_BYTE,
 			rgb
 		);
 
-		if (read_pipeline_payload(&msg, PAYLOAD_STATE))
+		int res = read_pipeline_payload(&msg, PAYLOAD_STATE);
+		if (res)
 		{
-			return -1;
+			return res == PIPE_EOF ? 0 : -1;
 		}
 
 		state = &msg.payload.state;
-		if (msg.header.type == PAYLOAD_PAIR)
-		{
-			state = &msg.payload.pair.state;
-		}
+		frame_w = msg.header.width;
+		frame_h = msg.header.height;
 
 		vec3_copy(positions[pos_idx++], state->position);
 		if(pos_idx == 1024) b_log("ROLLOVER");
 		pos_idx %= 1024;
-		yuv422_to_rgb(state->view.luma, state->view.chroma, rgb, FRAME_W, FRAME_H);
+		yuv422_to_rgb(state->view.luma, state->view.chroma, rgb, FRAME_W, frame_h);
 
 		glClear(GL_COLOR_BUFFER_BIT);
 		glEnable(GL_TEXTURE_2D);
@@ -0,0 +1,86 @@
+#include <assert.h>
+
+#include "window.h"
+
+// With prefix sums P, window [i, j) scores
+//
+//   (P[j] - P[i]) / (1 + (j - i) * w)  =  slope((i, P[i]), (j + 1 / w, P[j])) / w
+//
+// so for each end j the best start is the point of the lower convex hull of
+// (0, P[0]) ... (j - 1, P[j - 1]) a line through (j + 1 / w, P[j]) touches.
+// The hull only grows to the right, and slopes from its points to a query
+// right of them rise then fall, so each query is a binary search.
+
+typedef struct {
+	double x, y;
+} point_t;
+
+
+static double slope(point_t a, point_t b)
+{
+	return (b.y - a.y) / (b.x - a.x);
+}
+
+
+// > 0 if a, b, c turn counter clockwise
+static double cross(point_t a, point_t b, point_t c)
+{
+	return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+}
+
+
+float window_best(const float* hist, int n, float width_weight, int range[2])
+{
+	assert(width_weight > 0 && n <= WINDOW_MAX);
+
+	point_t hull[WINDOW_MAX];
+
+	float best = hist[n - 1];
+	double sum = 0;
+	int h = 0;
+
+	range[0] = range[1] = n;
+
+	for (int j = 1; j <= n; ++j)
+	{
+		point_t a = { j - 1, sum };
+
+		while (h >= 2 && cross(hull[h - 2], hull[h - 1], a) <= 0) --h;
+		hull[h++] = a;
+
+		sum += hist[j - 1];
+		point_t q = { j + 1 / (double)width_weight, sum };
+
+		int lo = 0, hi = h - 1;
+		while (lo < hi)
+		{
+			int mid = (lo + hi) / 2;
+
+			if (slope(hull[mid + 1], q) > slope(hull[mid], q)) lo = mid + 1;
+			else hi = mid;
+		}
+
+		const int i = hull[lo].x;
+		const float score = (float)(sum - hull[lo].y) / (1 + (j - i) * width_weight);
+
+		// later ends win ties between windows, as if scanned from the right
+		if (score > best || (score == best && range[0] < n))
+		{
+			best = score;
+			range[0] = i;
+			range[1] = j;
+		}
+	}
+
+	return best;
+}
+
+
+int window_patch_x(int ci, int bucket, int w, int patch)
+{
+	int x = ci * bucket;
+
+	if (x > w - patch) x = w - patch;
+
+	return x & ~1;
+}
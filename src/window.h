@@ -0,0 +1,31 @@
+#ifndef AVC_WINDOW
+#define AVC_WINDOW
+
+// most buckets window_best() takes, more than the widest frame has columns
+#define WINDOW_MAX 256
+
+/**
+ * @brief Finds the contiguous window [range[0], range[1]) of hist with the
+ *        highest score sum / (1 + width * width_weight). Unless a window
+ *        scores above hist[n - 1], range is left at { n, n }. Runs in
+ *        O(n log n).
+ * @param hist - [n] per bucket values
+ * @param n - buckets, at most WINDOW_MAX
+ * @param width_weight - must be above 0
+ * @param range - start and end of the best window
+ * @return score of the best window, or hist[n - 1]
+ */
+float window_best(const float* hist, int n, float width_weight, int range[2]);
+
+/**
+ * @brief Left edge of the patch sampled for bucket ci of a frame w pixels
+ *        wide. Patches of the buckets near the right edge are pulled back
+ *        inside the frame, and edges are always even so the patch's chroma
+ *        pairs with its own pixels.
+ * @param bucket - bucket width in pixels, may be odd
+ * @param w - frame width, must be even
+ * @param patch - patch width, must be even and at most w
+ */
+int window_patch_x(int ci, int bucket, int w, int patch);
+
+#endif
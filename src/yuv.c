@@ -0,0 +1,432 @@
+#include <stdlib.h>
+#include "yuv.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define YUV_X86
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define YUV_NEON
+#endif
+
+// Every implementation computes exactly these integer expressions per pixel
+//   r = sat(((y << YUV_SHIFT) + YUV_R_CB * db) >> YUV_SHIFT)
+//   g = sat(((y << YUV_SHIFT) - YUV_G_CR * dr - YUV_G_CB * db) >> YUV_SHIFT)
+//   b = sat(((y << YUV_SHIFT) + YUV_B_CR * dr) >> YUV_SHIFT)
+// where db = cb - 128 and dr = cr - 128, so their outputs match bit for bit.
+
+static inline uint8_t sat_u8(int v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+
+static void yuv422_to_rgb_scalar(const uint8_t* luma, const chroma_t* uv, color_t* rgb, int pixels)
+{
+	// chroma terms are computed once for the pair of pixels sharing them
+	for (int i = 0; i < pixels; i += 2)
+	{
+		const int db = uv[i >> 1].cb - 128;
+		const int dr = uv[i >> 1].cr - 128;
+		const int r = YUV_R_CB * db;
+		const int g = YUV_G_CR * dr + YUV_G_CB * db;
+		const int b = YUV_B_CR * dr;
+
+		for (int j = i; j < i + 2 && j < pixels; ++j)
+		{
+			const int y = luma[j];
+
+			rgb[j].r = sat_u8(((y << YUV_SHIFT) + r) >> YUV_SHIFT);
+			rgb[j].g = sat_u8(((y << YUV_SHIFT) - g) >> YUV_SHIFT);
+			rgb[j].b = sat_u8(((y << YUV_SHIFT) + b) >> YUV_SHIFT);
+		}
+	}
+}
+
+
+// The camera's second byte of each pixel pair lands in cr and its fourth in
+// cb, the order the collector has always stored them in.
+static void yuyv_unpack_scalar(const uint8_t* yuyv, uint8_t* luma, chroma_t* uv, int pixels)
+{
+	for (int i = 0; i < pixels; i += 2)
+	{
+		const uint8_t* px = yuyv + (i << 1);
+
+		luma[i + 0] = px[0];
+		luma[i + 1] = px[2];
+		uv[i >> 1].cr = px[1];
+		uv[i >> 1].cb = px[3];
+	}
+}
+
+
+#ifdef YUV_X86
+
+static int cpu_has_ssse3(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("ssse3");
+}
+
+
+static int cpu_has_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+
+__attribute__((target("ssse3")))
+static inline void store_rgb_ssse3(color_t* rgb, __m128i r, __m128i g, __m128i b)
+{
+	// byte shuffles spreading 16 pixels of each channel over 48 packed bytes
+	__m128i* dst = (__m128i*)rgb;
+	const __m128i r0 = _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5);
+	const __m128i g0 = _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1);
+	const __m128i b0 = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+	const __m128i r1 = _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1);
+	const __m128i g1 = _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10);
+	const __m128i b1 = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1);
+	const __m128i r2 = _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1);
+	const __m128i g2 = _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1);
+	const __m128i b2 = _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15);
+
+	_mm_storeu_si128(dst + 0, _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(r, r0), _mm_shuffle_epi8(g, g0)), _mm_shuffle_epi8(b, b0)));
+	_mm_storeu_si128(dst + 1, _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(r, r1), _mm_shuffle_epi8(g, g1)), _mm_shuffle_epi8(b, b1)));
+	_mm_storeu_si128(dst + 2, _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(r, r2), _mm_shuffle_epi8(g, g2)), _mm_shuffle_epi8(b, b2)));
+}
+
+
+__attribute__((target("ssse3")))
+static void yuv422_to_rgb_ssse3(const uint8_t* luma, const chroma_t* uv, color_t* rgb, int pixels)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i bias = _mm_set1_epi16(128);
+	// coefficient pairs for (y, db), (dr, db) and (y, dr) lanes
+	const __m128i k_r = _mm_setr_epi16(YUV_ONE, YUV_R_CB, YUV_ONE, YUV_R_CB, YUV_ONE, YUV_R_CB, YUV_ONE, YUV_R_CB);
+	const __m128i k_g = _mm_setr_epi16(-YUV_G_CR, -YUV_G_CB, -YUV_G_CR, -YUV_G_CB, -YUV_G_CR, -YUV_G_CB, -YUV_G_CR, -YUV_G_CB);
+	const __m128i k_b = _mm_setr_epi16(YUV_ONE, YUV_B_CR, YUV_ONE, YUV_B_CR, YUV_ONE, YUV_B_CR, YUV_ONE, YUV_B_CR);
+	int i = 0;
+
+	for (; i + 16 <= pixels; i += 16)
+	{
+		const __m128i y8 = _mm_loadu_si128((const __m128i*)(luma + i));
+		const __m128i c8 = _mm_loadu_si128((const __m128i*)(uv + (i >> 1)));
+		__m128i r16[2], g16[2], b16[2];
+
+		for (int h = 0; h < 2; ++h)
+		{
+			const __m128i y = h ? _mm_unpackhi_epi8(y8, zero) : _mm_unpacklo_epi8(y8, zero);
+			const __m128i c = _mm_sub_epi16(h ? _mm_unpackhi_epi8(c8, zero) : _mm_unpacklo_epi8(c8, zero), bias);
+
+			// spread each chroma sample over the two pixels sharing it
+			const __m128i db = _mm_shufflehi_epi16(_mm_shufflelo_epi16(c, _MM_SHUFFLE(2, 2, 0, 0)), _MM_SHUFFLE(2, 2, 0, 0));
+			const __m128i dr = _mm_shufflehi_epi16(_mm_shufflelo_epi16(c, _MM_SHUFFLE(3, 3, 1, 1)), _MM_SHUFFLE(3, 3, 1, 1));
+
+			r16[h] = _mm_packs_epi32(
+				_mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(y, db), k_r), YUV_SHIFT),
+				_mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(y, db), k_r), YUV_SHIFT)
+			);
+			g16[h] = _mm_packs_epi32(
+				_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(dr, db), k_g),
+					_mm_slli_epi32(_mm_unpacklo_epi16(y, zero), YUV_SHIFT)), YUV_SHIFT),
+				_mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(dr, db), k_g),
+					_mm_slli_epi32(_mm_unpackhi_epi16(y, zero), YUV_SHIFT)), YUV_SHIFT)
+			);
+			b16[h] = _mm_packs_epi32(
+				_mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(y, dr), k_b), YUV_SHIFT),
+				_mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(y, dr), k_b), YUV_SHIFT)
+			);
+		}
+
+		// unsigned saturation does the clamping
+		store_rgb_ssse3(rgb + i,
+			_mm_packus_epi16(r16[0], r16[1]),
+			_mm_packus_epi16(g16[0], g16[1]),
+			_mm_packus_epi16(b16[0], b16[1])
+		);
+	}
+
+	yuv422_to_rgb_scalar(luma + i, uv + (i >> 1), rgb + i, pixels - i);
+}
+
+
+__attribute__((target("ssse3")))
+static void yuyv_unpack_ssse3(const uint8_t* yuyv, uint8_t* luma, chroma_t* uv, int pixels)
+{
+	// 8 pixels per register, luma to the low half and chroma to the high
+	const __m128i split = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 3, 1, 7, 5, 11, 9, 15, 13);
+	int i = 0;
+
+	for (; i + 16 <= pixels; i += 16)
+	{
+		const __m128i a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(yuyv + (i << 1))), split);
+		const __m128i b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(yuyv + (i << 1) + 16)), split);
+
+		_mm_storeu_si128((__m128i*)(luma + i), _mm_unpacklo_epi64(a, b));
+		_mm_storeu_si128((__m128i*)(uv + (i >> 1)), _mm_unpackhi_epi64(a, b));
+	}
+
+	yuyv_unpack_scalar(yuyv + (i << 1), luma + i, uv + (i >> 1), pixels - i);
+}
+
+
+__attribute__((target("avx2")))
+static void yuyv_unpack_avx2(const uint8_t* yuyv, uint8_t* luma, chroma_t* uv, int pixels)
+{
+	const __m256i split = _mm256_setr_epi8(
+		0, 2, 4, 6, 8, 10, 12, 14, 3, 1, 7, 5, 11, 9, 15, 13,
+		0, 2, 4, 6, 8, 10, 12, 14, 3, 1, 7, 5, 11, 9, 15, 13
+	);
+	int i = 0;
+
+	for (; i + 32 <= pixels; i += 32)
+	{
+		const __m256i a = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(yuyv + (i << 1))), split);
+		const __m256i b = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(yuyv + (i << 1) + 32)), split);
+
+		// unpacking works per lane, the permute puts the quarters back in order
+		const __m256i y = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+		const __m256i c = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+
+		_mm256_storeu_si256((__m256i*)(luma + i), y);
+		_mm256_storeu_si256((__m256i*)(uv + (i >> 1)), c);
+	}
+
+	yuyv_unpack_ssse3(yuyv + (i << 1), luma + i, uv + (i >> 1), pixels - i);
+}
+
+
+__attribute__((target("avx2")))
+static void yuv422_to_rgb_avx2(const uint8_t* luma, const chroma_t* uv, color_t* rgb, int pixels)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i bias = _mm256_set1_epi16(128);
+	const __m256i k_r = _mm256_set1_epi32((YUV_R_CB << 16) | YUV_ONE);
+	const __m256i k_g = _mm256_set1_epi32((int)(((uint32_t)-YUV_G_CB << 16) | (uint16_t)-YUV_G_CR));
+	const __m256i k_b = _mm256_set1_epi32((YUV_B_CR << 16) | YUV_ONE);
+	int i = 0;
+
+	// same lane arrangement as the ssse3 version, each 128 bit half
+	// handles 8 pixels so every unpack and pack stays within its lane
+	for (; i + 16 <= pixels; i += 16)
+	{
+		const __m256i y = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(luma + i)));
+		const __m256i c = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(uv + (i >> 1)))), bias);
+		const __m256i db = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(c, _MM_SHUFFLE(2, 2, 0, 0)), _MM_SHUFFLE(2, 2, 0, 0));
+		const __m256i dr = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(c, _MM_SHUFFLE(3, 3, 1, 1)), _MM_SHUFFLE(3, 3, 1, 1));
+
+		const __m256i r = _mm256_packs_epi32(
+			_mm256_srai_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(y, db), k_r), YUV_SHIFT),
+			_mm256_srai_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(y, db), k_r), YUV_SHIFT)
+		);
+		const __m256i g = _mm256_packs_epi32(
+			_mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(dr, db), k_g),
+				_mm256_slli_epi32(_mm256_unpacklo_epi16(y, zero), YUV_SHIFT)), YUV_SHIFT),
+			_mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(dr, db), k_g),
+				_mm256_slli_epi32(_mm256_unpackhi_epi16(y, zero), YUV_SHIFT)), YUV_SHIFT)
+		);
+		const __m256i b = _mm256_packs_epi32(
+			_mm256_srai_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(y, dr), k_b), YUV_SHIFT),
+			_mm256_srai_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(y, dr), k_b), YUV_SHIFT)
+		);
+
+		// packing interleaves the halves, permute puts r in the low half, g in the high
+		const __m256i rg = _mm256_permute4x64_epi64(_mm256_packus_epi16(r, g), _MM_SHUFFLE(3, 1, 2, 0));
+		const __m256i bb = _mm256_permute4x64_epi64(_mm256_packus_epi16(b, b), _MM_SHUFFLE(3, 1, 2, 0));
+
+		store_rgb_ssse3(rgb + i,
+			_mm256_castsi256_si128(rg),
+			_mm256_extracti128_si256(rg, 1),
+			_mm256_castsi256_si128(bb)
+		);
+	}
+
+	yuv422_to_rgb_scalar(luma + i, uv + (i >> 1), rgb + i, pixels - i);
+}
+
+#endif
+
+
+#ifdef YUV_NEON
+
+static inline int16x8_t neon_madd(int16x8_t y, int16x8_t d, int16_t k)
+{
+	const int32x4_t lo = vshrq_n_s32(vmlal_n_s16(vshll_n_s16(vget_low_s16(y), YUV_SHIFT), vget_low_s16(d), k), YUV_SHIFT);
+	const int32x4_t hi = vshrq_n_s32(vmlal_n_s16(vshll_n_s16(vget_high_s16(y), YUV_SHIFT), vget_high_s16(d), k), YUV_SHIFT);
+	return vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi));
+}
+
+
+static void yuv422_to_rgb_neon(const uint8_t* luma, const chroma_t* uv, color_t* rgb, int pixels)
+{
+	const int16x8_t bias = vdupq_n_s16(128);
+	int i = 0;
+
+	for (; i + 16 <= pixels; i += 16)
+	{
+		const uint8x16_t y8 = vld1q_u8(luma + i);
+		const uint8x8x2_t c8 = vld2_u8((const uint8_t*)(uv + (i >> 1)));
+		const int16x8_t cb = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(c8.val[0])), bias);
+		const int16x8_t cr = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(c8.val[1])), bias);
+
+		// spread each chroma sample over the two pixels sharing it
+		const int16x8x2_t db = vzipq_s16(cb, cb);
+		const int16x8x2_t dr = vzipq_s16(cr, cr);
+		uint8x8_t r[2], g[2], b[2];
+
+		for (int h = 0; h < 2; ++h)
+		{
+			const int16x8_t y = vreinterpretq_s16_u16(vmovl_u8(h ? vget_high_u8(y8) : vget_low_u8(y8)));
+			const int32x4_t g_lo = vshrq_n_s32(vmlsl_n_s16(vmlsl_n_s16(vshll_n_s16(vget_low_s16(y), YUV_SHIFT),
+				vget_low_s16(dr.val[h]), YUV_G_CR), vget_low_s16(db.val[h]), YUV_G_CB), YUV_SHIFT);
+			const int32x4_t g_hi = vshrq_n_s32(vmlsl_n_s16(vmlsl_n_s16(vshll_n_s16(vget_high_s16(y), YUV_SHIFT),
+				vget_high_s16(dr.val[h]), YUV_G_CR), vget_high_s16(db.val[h]), YUV_G_CB), YUV_SHIFT);
+
+			r[h] = vqmovun_s16(neon_madd(y, db.val[h], YUV_R_CB));
+			g[h] = vqmovun_s16(vcombine_s16(vqmovn_s32(g_lo), vqmovn_s32(g_hi)));
+			b[h] = vqmovun_s16(neon_madd(y, dr.val[h], YUV_B_CR));
+		}
+
+		uint8x16x3_t px = {{
+			vcombine_u8(r[0], r[1]),
+			vcombine_u8(g[0], g[1]),
+			vcombine_u8(b[0], b[1]),
+		}};
+		vst3q_u8((uint8_t*)(rgb + i), px);
+	}
+
+	yuv422_to_rgb_scalar(luma + i, uv + (i >> 1), rgb + i, pixels - i);
+}
+
+
+static void yuyv_unpack_neon(const uint8_t* yuyv, uint8_t* luma, chroma_t* uv, int pixels)
+{
+	int i = 0;
+
+	for (; i + 32 <= pixels; i += 32)
+	{
+		const uint8x16x4_t px = vld4q_u8(yuyv + (i << 1));
+		const uint8x16x2_t y = {{ px.val[0], px.val[2] }};
+		const uint8x16x2_t c = {{ px.val[3], px.val[1] }};
+
+		vst2q_u8(luma + i, y);
+		vst2q_u8((uint8_t*)(uv + (i >> 1)), c);
+	}
+
+	yuyv_unpack_scalar(yuyv + (i << 1), luma + i, uv + (i >> 1), pixels - i);
+}
+
+#endif
+
+
+const yuv_impl_t YUV_IMPLS[] = {
+#ifdef YUV_X86
+	{ "avx2", yuv422_to_rgb_avx2, yuyv_unpack_avx2, cpu_has_avx2 },
+	{ "ssse3", yuv422_to_rgb_ssse3, yuyv_unpack_ssse3, cpu_has_ssse3 },
+#endif
+#ifdef YUV_NEON
+	{ "neon", yuv422_to_rgb_neon, yuyv_unpack_neon, NULL },
+#endif
+	{ "scalar", yuv422_to_rgb_scalar, yuyv_unpack_scalar, NULL },
+	{}
+};
+
+
+const yuv_impl_t* yuv_impl(void)
+{
+	static const yuv_impl_t* best;
+	const yuv_impl_t* impl = __atomic_load_n(&best, __ATOMIC_ACQUIRE);
+
+	if (impl) return impl;
+
+	// threads racing here all pick the same entry
+	for (impl = YUV_IMPLS; impl->supported && !impl->supported(); ++impl);
+	__atomic_store_n(&best, impl, __ATOMIC_RELEASE);
+
+	return impl;
+}
+
+
+void yuyv_unpack(const uint8_t* yuyv, uint8_t* luma, chroma_t* uv, int pixels)
+{
+	yuv_impl()->unpack(yuyv, luma, uv, pixels);
+}
+
+
+void yuv422_to_rgb(const uint8_t* luma, const chroma_t* uv, color_t* rgb, int w, int h)
+{
+	// rows are contiguous and w is even, so pixel i always pairs with chroma i / 2
+	yuv_impl()->convert(luma, uv, rgb, w * h);
+}
+
+
+// Rows are converted a chunk at a time into scratch that never leaves L1,
+// then widened into the output which has the same channel order.
+void yuv422_region_f(const uint8_t* luma, const chroma_t* uv, int w, int x, int y, int w_r, int h_r, float* out)
+{
+	yuv_rgb_fn convert = yuv_impl()->convert;
+	color_t row[YUV_PATCH_MAX];
+	const uint8_t* bytes = (const uint8_t*)row;
+
+	for (int r = 0; r < h_r; ++r)
+	for (int c = 0; c < w_r; c += YUV_PATCH_MAX)
+	{
+		const int p = (y + r) * w + x + c;
+		const int pixels = w_r - c < YUV_PATCH_MAX ? w_r - c : YUV_PATCH_MAX;
+		float* out_rc = out + (r * w_r + c) * 3;
+
+		convert(luma + p, uv + (p >> 1), row, pixels);
+
+		for (int i = 0; i < pixels * 3; ++i)
+		{
+			out_rc[i] = bytes[i];
+		}
+	}
+}
+
+
+void yuv422_patch_f(const uint8_t* luma, const chroma_t* uv, int w, int x, int y, int size, float* out)
+{
+	yuv422_region_f(luma, uv, w, x, y, size, size, out);
+}
+
+
+void yuv422_patch_q8(const uint8_t* luma, const chroma_t* uv, int w, int x, int y, int size, int8_t* out)
+{
+	yuv_rgb_fn convert = yuv_impl()->convert;
+	color_t row[YUV_PATCH_MAX];
+	const uint8_t* bytes = (const uint8_t*)row;
+	const int row_len = size * 3;
+
+	for (int r = 0; r < size; ++r, out += row_len)
+	{
+		int p = (y + r) * w + x;
+		convert(luma + p, uv + (p >> 1), row, size);
+
+		for (int i = 0; i < row_len; ++i)
+		{
+			out[i] = bytes[i] - 128;
+		}
+	}
+}
+
+
+// a plain loop, at -O3 the compiler vectorizes it (psadbw on x86)
+uint32_t yuv_luma_sad(const uint8_t* a, int a_pitch, const uint8_t* b, int b_pitch, int w, int h)
+{
+	uint32_t sad = 0;
+
+	for (int r = 0; r < h; ++r, a += a_pitch, b += b_pitch)
+	for (int c = 0; c < w; ++c)
+	{
+		sad += abs(a[c] - b[c]);
+	}
+
+	return sad;
+}
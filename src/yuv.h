@@ -0,0 +1,95 @@
+#ifndef AVC_YUV
+#define AVC_YUV
+
+#include <inttypes.h>
+
+#include "structs.h"
+
+// Fixed point conversion coefficients, scaled by 2^YUV_SHIFT
+#define YUV_SHIFT 13
+#define YUV_ONE   (1 << YUV_SHIFT)
+#define YUV_R_CB  9339  // 1.14
+#define YUV_G_CR  3236  // 0.395
+#define YUV_G_CB  4760  // 0.581
+#define YUV_B_CR  16654 // 2.033
+
+/**
+ * @brief Converts a run of pixels from planar luma and interleaved 4:2:2
+ *        chroma to packed rgb. Pixel i uses chroma sample i / 2.
+ * @param luma - first luma sample of the run
+ * @param uv - chroma sample shared by the first two pixels of the run
+ * @param rgb - destination for 'pixels' colors
+ * @param pixels - number of pixels to convert
+ */
+typedef void (*yuv_rgb_fn)(const uint8_t* luma, const chroma_t* uv, color_t* rgb, int pixels);
+
+/**
+ * @brief Splits packed YUYV pixels, as cameras deliver them, into planar
+ *        luma and interleaved chroma. The second byte of each pixel pair is
+ *        stored as cr and the fourth as cb.
+ * @param pixels - number of pixels to split, must be even
+ */
+typedef void (*yuyv_unpack_fn)(const uint8_t* yuyv, uint8_t* luma, chroma_t* uv, int pixels);
+
+typedef struct {
+	const char* name;
+	yuv_rgb_fn convert;
+	yuyv_unpack_fn unpack;
+	int (*supported)(void); // NULL if always available
+} yuv_impl_t;
+
+/**
+ * @brief Every converter built for this target, fastest first and terminated
+ *        by an empty entry. All of them produce identical output.
+ */
+extern const yuv_impl_t YUV_IMPLS[];
+
+/**
+ * @brief Returns the fastest converter the running cpu supports.
+ */
+const yuv_impl_t* yuv_impl(void);
+
+/**
+ * @brief Splits 'pixels' packed YUYV pixels with the fastest implementation.
+ */
+void yuyv_unpack(const uint8_t* yuyv, uint8_t* luma, chroma_t* uv, int pixels);
+
+/**
+ * @brief Converts a whole w x h frame to rgb. w must be even.
+ */
+void yuv422_to_rgb(const uint8_t* luma, const chroma_t* uv, color_t* rgb, int w, int h);
+
+#define YUV_PATCH_MAX 64
+
+/**
+ * @brief Converts a size x size patch of a frame w pixels wide straight into
+ *        one contiguous row of r, g, b values, element (r * size + c) * 3 + ch.
+ *        Values are the raw 0-255 channel values.
+ * @param x - left column of the patch, must be even
+ * @param y - top row of the patch
+ * @param size - side of the patch, at most YUV_PATCH_MAX
+ */
+void yuv422_patch_f(const uint8_t* luma, const chroma_t* uv, int w, int x, int y, int size, float* out);
+
+/**
+ * @brief Converts a w_r x h_r region at (x, y) of a frame w pixels wide into
+ *        rows of interleaved r, g, b values, raw 0-255 like yuv422_patch_f().
+ * @param x - left column of the region, must be even
+ * @param w_r - width of the region, must be even
+ * @param out - [h_r][w_r * 3] output
+ */
+void yuv422_region_f(const uint8_t* luma, const chroma_t* uv, int w, int x, int y, int w_r, int h_r, float* out);
+
+/**
+ * @brief Same as yuv422_patch_f() but writes channel values - 128.
+ */
+void yuv422_patch_q8(const uint8_t* luma, const chroma_t* uv, int w, int x, int y, int size, int8_t* out);
+
+/**
+ * @brief Sum of absolute differences between two w x h blocks of luma.
+ * @param a_pitch - bytes per row of a
+ * @param b_pitch - bytes per row of b
+ */
+uint32_t yuv_luma_sad(const uint8_t* a, int a_pitch, const uint8_t* b, int b_pitch, int w, int h);
+
+#endif